@@ -0,0 +1,293 @@
+//
+// Microbenchmarks for the work the controller does on every scan, command and event. Reports
+// the time and the number of heap allocations per operation, and compares them with a
+// baseline file so a change that slows a hot path down shows up in review.
+//
+//g++ -o chesslrbench -std=c++11 -O2 -I src/main/cpp src/main/cpp/bench.cpp src/main/cpp/thc.cpp -lpthread
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "thc.h"
+#include "chessaction.hpp"
+#include "board.hpp"
+#include "eventencoder.hpp"
+#include "binaryprotocol.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+static uint64_t allocations=0;
+
+void* operator new(size_t n) {
+    allocations++;
+    void* p = malloc(n ? n : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p,size_t) noexcept {
+    free(p);
+}
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p,size_t) noexcept {
+    free(p);
+}
+
+/** Keeps the compiler from optimizing away a result that is never used. */
+template<class T> inline void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/** Sensors that see whatever the benchmark puts in occupancy, and LEDs that go nowhere. */
+class BenchIO : public BoardIO {
+public:
+    uint64_t occupancy;
+
+    BenchIO() : occupancy(0xffff00000000ffffULL) {}
+    uint64_t scan() {return occupancy;}
+    void setLed(int index,int on) {}
+    void delay(unsigned us) {}
+};
+
+class BenchListener : public BoardListener {
+public:
+    void onPiece(Board* board,int index,int state) {}
+    void onInspect(Board* board,int index,int state) {}
+    void onMove(Board* board,int from,int to,thc::Move mv,const char* san,bool capture,bool check) {}
+    void onInvalidMove(Board* board,int from,int to,const char* lan,const char* san) {}
+    void onMoveFinished(Board* board) {}
+    void onSetPositionComplete(Board* board) {}
+    void onGameOver(Board* board) {}
+};
+
+struct Result {
+    double ns;              ///< Per operation.
+    double allocs;          ///< Per operation.
+};
+
+/**
+ * Runs the operation in growing batches until a batch takes at least the given time, and
+ * reports the last batch.
+ */
+template<class F> Result run(F op,uint64_t minimumMicros) {
+    for(uint64_t n=1;; n*=2) {
+        uint64_t before = allocations;
+        uint64_t start = monotonicMicros();
+        for(uint64_t i=0; i<n; i++)
+            op();
+        uint64_t elapsed = monotonicMicros()-start;
+        if(elapsed >= minimumMicros || n >= (1ULL<<30)) {
+            Result r;
+            r.ns = elapsed*1000.0/n;
+            r.allocs = (double)(allocations-before)/n;
+            return r;
+        }
+    }
+}
+
+/** Reads a baseline written with --save, name, ns/op and allocs/op on each line. */
+map<string,Result> loadBaseline(const char* path) {
+    map<string,Result> baseline;
+    FILE* file = fopen(path,"r");
+    if(!file) {
+        perror(path);
+        return baseline;
+    }
+    char line[256],name[128];
+    Result r;
+    while(fgets(line,sizeof(line),file)) {
+        if(line[0] != '#' && sscanf(line,"%127s %lf %lf",name,&r.ns,&r.allocs) == 3)
+            baseline[name] = r;
+    }
+    fclose(file);
+    return baseline;
+}
+
+void usage() {
+    printf("usage: chesslrbench [--filter text] [--time ms] [--baseline file] [--save file [--machine text]]\n"
+           "  --filter text    only run the benchmarks with text in their name\n"
+           "  --time ms        run each benchmark for at least this long, default 200\n"
+           "  --baseline file  compare with a baseline, flagging anything 20%% slower or allocating more\n"
+           "  --save file      write the results as a new baseline\n"
+           "  --machine text   what the baseline was measured on, written as a comment\n");
+}
+
+int main(int argc,char* argv[]) {
+    const char* filter = NULL;
+    const char* baselinePath = NULL;
+    const char* savePath = NULL;
+    const char* machine = NULL;
+    uint64_t minimumMicros = 200000;
+    for(int i=1; i<argc; i++) {
+        if(!strcmp(argv[i],"--filter") && i+1<argc) {
+            filter = argv[++i];
+        } else if(!strcmp(argv[i],"--time") && i+1<argc) {
+            minimumMicros = (uint64_t)atoi(argv[++i])*1000;
+        } else if(!strcmp(argv[i],"--baseline") && i+1<argc) {
+            baselinePath = argv[++i];
+        } else if(!strcmp(argv[i],"--save") && i+1<argc) {
+            savePath = argv[++i];
+        } else if(!strcmp(argv[i],"--machine") && i+1<argc) {
+            machine = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    Logger::instance().setLevel(Logger::LEVEL_WARN);
+
+    const char* start = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    const char* scandinavian = "rnbqkbnr/ppp1pppp/8/3p4/4P3/8/PPPP1PPP/RNBQKBNR w KQkq d6 0 2";
+    const char* middlegame = "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N2N2/PP2BPPP/R2QKB1R w KQ - 0 8";
+    const char* command = "{\"action\":\"move\",\"description\":null,\"moves\":[{\"from\":\"e2\",\"to\":\"e4\",\"type\":\"move\"}]}";
+
+    BenchListener listener;
+    BenchIO io;
+    Board board(0,&listener,&io);
+    board.setPosition(start);
+    board.rescan();
+
+    BoardRules rules;
+    rules.Forsyth(middlegame);
+    BoardRules beforeExd5;
+    beforeExd5.Forsyth(scandinavian);
+    BoardRules opening;
+    EventEncoder events;
+    FrameEncoder frames;
+    thc::Move e4;
+    e4.TerseIn(&opening,"e2e4");
+
+    struct Bench {
+        const char* name;
+        Result result;
+    };
+    vector<Bench> results;
+#define BENCH(name,...) \
+    if(!filter || strstr(name,filter)) { \
+        Bench b = {name,run([&]() __VA_ARGS__,minimumMicros)}; \
+        results.push_back(b); \
+    }
+
+    BENCH("json_parse_action",{
+        json j = json::parse(command);
+        ChessAction ca(j);
+        keep(ca);
+    });
+    BENCH("show_valid_squares",{
+        keep(board.showValidSquares(52));     //e2
+    });
+    BENCH("finish_move_capture",{
+        //exd5 from the Scandinavian, the board resyncs to the position after it
+        board.rules = beforeExd5;
+        board.played.clear();
+        board.moveSquareIndex[0] = 36;
+        board.finishMove(27);
+    });
+    BENCH("move_san_check_capture",{
+        //what finishMove derives from a move before it plays it
+        thc::Move mv;
+        mv.TerseIn(&beforeExd5,"e4d5");
+        string san = mv.NaturalOut(&beforeExd5);
+        bool check = beforeExd5.isCheck(mv);
+        bool capture = mv.NaturalOut(&beforeExd5).find('x') != string::npos;
+        keep(san); keep(check); keep(capture);
+    });
+    BENCH("set_position_fen",{
+        board.setPosition(middlegame);
+    });
+    BENCH("forsyth",{
+        thc::ChessRules cr;
+        keep(cr.Forsyth(middlegame));
+    });
+    BENCH("forsyth_publish",{
+        string fen = rules.ForsythPublish();
+        keep(fen);
+    });
+    BENCH("gen_legal_move_list",{
+        vector<thc::Move> moves;
+        vector<bool> check,mate,stalemate;
+        rules.GenLegalMoveList(moves,check,mate,stalemate);
+        keep(moves);
+    });
+    BENCH("flasher",{
+        board.flasher();
+    });
+    BENCH("idle_no_change",{
+        //one scan of a board where nothing moved, the common case
+        board.idle(0);
+    });
+    BENCH("event_json_piece",{
+        keep(events.piece(true,"e4",0,12345));
+    });
+    BENCH("event_json_move",{
+        keep(events.move("move","e2","e4","e2e4","e4",0,12345));
+    });
+    BENCH("event_binary_piece",{
+        keep(frames.piece(true,36,io.occupancy,0,12345,1600000000000000ULL));
+    });
+    BENCH("event_binary_move",{
+        keep(frames.move(packMove(e4),0,0,12345,1600000000000000ULL));
+    });
+#undef BENCH
+
+    map<string,Result> baseline;
+    if(baselinePath)
+        baseline = loadBaseline(baselinePath);
+    int regressions=0;
+    printf("%-24s %12s %10s", "benchmark","ns/op","allocs/op");
+    if(baselinePath)
+        printf(" %12s %10s %8s","base ns/op","allocs/op","change");
+    printf("\n");
+    for(size_t i=0; i<results.size(); i++) {
+        Bench& b = results[i];
+        printf("%-24s %12.1f %10.1f",b.name,b.result.ns,b.result.allocs);
+        map<string,Result>::iterator it = baseline.find(b.name);
+        if(it != baseline.end()) {
+            double change = it->second.ns > 0 ? (b.result.ns/it->second.ns-1)*100 : 0;
+            bool worse = change > 20 || b.result.allocs > it->second.allocs+0.05;
+            printf(" %12.1f %10.1f %+7.0f%%%s",it->second.ns,it->second.allocs,change,worse ? " !" : "");
+            if(worse)
+                regressions++;
+        }
+        printf("\n");
+    }
+    if(baselinePath)
+        printf("%d regressions\n",regressions);
+
+    if(savePath) {
+        FILE* file = fopen(savePath,"w");
+        if(!file) {
+            perror(savePath);
+            return 1;
+        }
+        fprintf(file,"# chesslrbench baseline: benchmark ns/op allocs/op\n");
+        if(machine)
+            fprintf(file,"# %s\n",machine);
+        for(size_t i=0; i<results.size(); i++)
+            fprintf(file,"%s %.1f %.1f\n",results[i].name,results[i].result.ns,results[i].result.allocs);
+        fclose(file);
+    }
+    return regressions ? 2 : 0;
+}
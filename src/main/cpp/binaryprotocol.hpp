@@ -0,0 +1,169 @@
+//
+// Compact binary framing for clients that don't want to parse json lines.
+//
+
+#ifndef CONTROLLER_BINARYPROTOCOL_HPP
+#define CONTROLLER_BINARYPROTOCOL_HPP
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <string>
+
+#include "thc.h"
+
+using namespace std;
+
+/**
+ * Frame opcodes. A client switches to binary with {"action":"hello","protocol":"binary"}, after
+ * the json reply to that command everything the controller sends it is a frame:
+ *
+ * ```
+ * u16 length       bytes that follow, opcode included
+ * u8  opcode
+ * ... payload
+ * ```
+ *
+ * All integers are little endian. Event payloads start with the u64 sequence number and a u64
+ * timestamp in microseconds since the epoch of when the board sensed what caused the event,
+ * then the u8 id of the board it happened on. Squares are board indexes, 0=a8 to 63=h1, and
+ * bit n of a bitboard is square n. Moves are packed into 16 bits the same way thc::Move holds them:
+ * src in bits 0-5, dst in bits 6-11 and the thc::SPECIAL in bits 12-15.
+ */
+enum {
+    OP_PIECE_UP     = 0x01,     ///< seq, time, u8 board, u8 square, u64 occupancy after the change
+    OP_PIECE_DOWN   = 0x02,     ///< seq, time, u8 board, u8 square, u64 occupancy after the change
+    OP_MOVE         = 0x03,     ///< seq, time, u8 board, u16 move, u8 flags (MOVE_FLAG_*)
+    OP_INVALID_MOVE = 0x04,     ///< seq, time, u8 board, u16 move
+    OP_SETPOSITION  = 0x05,     ///< seq, time, u8 board; setting up the position is complete
+    OP_DIFF         = 0x06,     ///< time, u8 board, u64 occupancy, u64 leds, u64 flash; bits that changed since the last diff or snapshot
+    OP_TEXT         = 0x10      ///< a line of text without its terminator, like json replies to commands
+};
+
+enum {
+    MOVE_FLAG_CAPTURE   = 0x01,
+    MOVE_FLAG_CHECK     = 0x02
+};
+
+/** Packs a move into 16 bits, see the opcode description. */
+inline uint16_t packMove(int src,int dst,int special) {
+    return (uint16_t)((src&0x3f) | (dst&0x3f)<<6 | (special&0x0f)<<12);
+}
+
+inline uint16_t packMove(thc::Move mv) {
+    return packMove(mv.src,mv.dst,mv.special);
+}
+
+/** Finds the legal move in the position that packMove() packed, which also fills in what it captures. */
+inline bool unpackMove(thc::ChessRules& rules,uint16_t packed,thc::Move& mv) {
+    thc::MOVELIST list;
+    rules.GenLegalMoveList(&list);
+    for(int i=0; i<list.count; i++) {
+        if(packMove(list.moves[i]) == packed) {
+            mv = list.moves[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Microseconds since the epoch, the clock used for frame timestamps. */
+inline uint64_t frameTime() {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+/**
+ * Builds binary frames, the binary counterpart of EventEncoder. Each method renders a
+ * complete frame into a reused buffer that is only valid until the next call.
+ */
+class FrameEncoder {
+protected:
+    string m_buffer;
+
+    void begin(int opcode) {
+        m_buffer.assign(2,'\0');    //length is filled in by end()
+        m_buffer += (char)opcode;
+    }
+
+    void beginEvent(int opcode,int board,unsigned long seq,uint64_t time) {
+        begin(opcode);
+        put64(seq);
+        put64(time);
+        put8(board);
+    }
+
+    const string& end() {
+        size_t n = m_buffer.size()-2;
+        m_buffer[0] = (char)(n&0xff);
+        m_buffer[1] = (char)(n>>8&0xff);
+        return m_buffer;
+    }
+
+    void put8(unsigned v) {
+        m_buffer += (char)(v&0xff);
+    }
+
+    void put16(unsigned v) {
+        put8(v);
+        put8(v>>8);
+    }
+
+    void put64(uint64_t v) {
+        for(int i=0; i<8; i++) {
+            put8((unsigned)(v>>(i*8)));
+        }
+    }
+
+public:
+    enum {MAX_PAYLOAD=0xffff-1};
+
+    FrameEncoder() {
+        m_buffer.reserve(64);
+    }
+
+    const string& piece(bool down,int square,uint64_t occupancy,int board,unsigned long seq,uint64_t time) {
+        beginEvent(down ? OP_PIECE_DOWN : OP_PIECE_UP,board,seq,time);
+        put8(square);
+        put64(occupancy);
+        return end();
+    }
+
+    const string& move(uint16_t move,unsigned flags,int board,unsigned long seq,uint64_t time) {
+        beginEvent(OP_MOVE,board,seq,time);
+        put16(move);
+        put8(flags);
+        return end();
+    }
+
+    const string& invalidMove(uint16_t move,int board,unsigned long seq,uint64_t time) {
+        beginEvent(OP_INVALID_MOVE,board,seq,time);
+        put16(move);
+        return end();
+    }
+
+    const string& setPositionComplete(int board,unsigned long seq,uint64_t time) {
+        beginEvent(OP_SETPOSITION,board,seq,time);
+        return end();
+    }
+
+    /** Diff frames aren't events, they have no sequence number. */
+    const string& diff(int board,uint64_t occupancy,uint64_t leds,uint64_t flash) {
+        begin(OP_DIFF);
+        put64(frameTime());
+        put8(board);
+        put64(occupancy);
+        put64(leds);
+        put64(flash);
+        return end();
+    }
+
+    /** Wraps a line of text in a frame. Text longer than MAX_PAYLOAD is truncated. */
+    const string& text(const char* text,size_t n) {
+        begin(OP_TEXT);
+        m_buffer.append(text,n < MAX_PAYLOAD ? n : MAX_PAYLOAD);
+        return end();
+    }
+};
+
+#endif //CONTROLLER_BINARYPROTOCOL_HPP
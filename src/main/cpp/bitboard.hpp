@@ -0,0 +1,69 @@
+//
+// 64 bit sets of squares, one bit per square.
+//
+
+#ifndef CONTROLLER_BITBOARD_HPP
+#define CONTROLLER_BITBOARD_HPP
+
+#include <stdint.h>
+
+/**
+ * Bit n is square n, 0=a8 to 63=h1, the same numbering as the board indexes. The board keeps
+ * what it senses, what it expects and its LEDs as bitboards, so comparing one with another is
+ * a couple of word operations instead of a loop over the squares.
+ */
+typedef uint64_t Bitboard;
+
+inline Bitboard squareBit(int index) {
+    return 1ULL<<index;
+}
+
+inline bool testBit(Bitboard bits,int index) {
+    return (bits>>index)&1;
+}
+
+/** Sets the square's bit if on is true, clears it otherwise. */
+inline void setBit(Bitboard& bits,int index,bool on) {
+    if(on)
+        bits |= squareBit(index);
+    else
+        bits &= ~squareBit(index);
+}
+
+inline int popCount(Bitboard bits) {
+    return __builtin_popcountll(bits);
+}
+
+/** Lowest square in the set, bits must not be 0. */
+inline int firstSquare(Bitboard bits) {
+    return __builtin_ctzll(bits);
+}
+
+/**
+ * Walks the squares of a set from lowest to highest, for example the squares that changed
+ * since the last scan:
+ *
+ *     for(int i : Squares(sensed^squareState))
+ *         ...
+ */
+class Squares {
+protected:
+    Bitboard m_bits;
+
+public:
+    class iterator {
+    protected:
+        Bitboard m_bits;
+    public:
+        iterator(Bitboard bits) : m_bits(bits) {}
+        int operator*() const {return firstSquare(m_bits);}
+        iterator& operator++() {m_bits &= m_bits-1; return *this;}
+        bool operator!=(const iterator& other) const {return m_bits != other.m_bits;}
+    };
+
+    Squares(Bitboard bits) : m_bits(bits) {}
+    iterator begin() const {return iterator(m_bits);}
+    iterator end() const {return iterator(0);}
+};
+
+#endif //CONTROLLER_BITBOARD_HPP
@@ -0,0 +1,754 @@
+//
+// One physical board: its I2C chips, LEDs and reed switches, and the game being played on it.
+//
+
+#ifndef CONTROLLER_BOARD_HPP
+#define CONTROLLER_BOARD_HPP
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "thc.h"
+#include "chessmove.hpp"
+#include "chessaction.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "boardio.hpp"
+#include "binaryprotocol.hpp"
+#include "bitboard.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+#define MOVE_UP 'U'
+#define MOVE_DOWN 'D'
+#define MOVE_NONE '_'
+
+#define LED_OFF 0
+#define LED_ON 1
+#define LED_FLASH 3
+
+#define SAN_BUF_SIZE 6      ///< Minimum buffer size to hold a san or long san move. Something like long "h7h8q" or san "h8=Q+"
+
+class BoardRules : public thc::ChessRules {
+public:
+    char pieceAt(int i) {
+        return squares[i];
+    }
+
+    /** Bitboard of the squares the position has a piece on. */
+    Bitboard occupancy() {
+        Bitboard bits=0;
+        for(int i=0; i<64; i++) {
+            if(squares[i] != ' ')
+                bits |= squareBit(i);
+        }
+        return bits;
+    }
+
+    /** Starts over from a position, like Forsyth() does, with no moves played before it. */
+    void setPosition(const thc::ChessPosition& position) {
+        thc::ChessRules::operator=(position);
+    }
+
+    /**
+     * Returns true if the move is a checking move (ends with '+'. Note
+     * you should do the check before calling PlayMove.
+     *
+     * @param mv Move before it is played.
+     * @return true if it is a check, false otherwise.
+     */
+    bool isCheck(thc::Move mv) {
+        return mv.NaturalOut(this).find_first_of('+') == string::npos ? false:true;
+    }
+};
+
+class Board;
+
+/** What a board tells the controller about, so it can let the clients know. */
+class BoardListener {
+public:
+    virtual ~BoardListener() {}
+    /** A piece was lifted (state 0) or put down (state 1). */
+    virtual void onPiece(Board* board,int index,int state)=0;
+    /** Same as onPiece, but while the board is in inspect mode. */
+    virtual void onInspect(Board* board,int index,int state)=0;
+    /** The player made a legal move, called before it is played. */
+    virtual void onMove(Board* board,int from,int to,thc::Move mv,const char* san,bool capture,bool check)=0;
+    virtual void onInvalidMove(Board* board,int from,int to,const char* lan,const char* san)=0;
+    /** The player finished the move the board was waiting for, see Board::waitMove. */
+    virtual void onMoveFinished(Board* board)=0;
+    /** The pieces are where the position set with setPosition wants them. */
+    virtual void onSetPositionComplete(Board* board)=0;
+    /** The game ended in mate, or is being replaced by another with moves played in it. Board::played has its moves. */
+    virtual void onGameOver(Board* board)=0;
+};
+
+/**
+ * A board and the game being played on it. The sensors and LEDs are reached through a BoardIO,
+ * normally the chips on the I2C bus (WiringPiIO).
+ */
+class Board {
+public:
+    enum {MODE_SETUP,MODE_INSPECT,MODE_PLAY,MODE_MOVE,MODE_SETPOSITION,MODE_MATE};
+    enum {MAX_SCANS_PER_IDLE=1000};     ///< Limit on catching up with a backlog, see BoardIO::backlog().
+    enum {STILL_MS=2000};               ///< How long nothing has to happen before scans back off.
+    enum {FIRST_BACKOFF_MS=20};         ///< The first backed off interval, it doubles from there.
+
+    int id;                     ///< What clients call the board, its index in the controller's list.
+    BoardListener* listener;
+    BoardRules rules;
+    int gameMode;
+    int flashState=0;
+    ChessMove waitMove;         ///< The move the board is waiting for the player to complete.
+    char moveType[4]= {'_','_','_','_'};
+    int moveSquareIndex[4]={-1,-1,-1,-1};
+    int moveIndex=0;            ///< Zero indicates not pointing at anything.
+    int movesNeeded=0;
+    BoardIO* io;
+    Bitboard sensed;            ///< Occupancy from the last scan, what readState() reports.
+    uint64_t sensedAt;          ///< When what the last scan saw happened, microseconds since the epoch. Used as the event timestamp.
+    unsigned scanInterval;      ///< Milliseconds between scans while the board is in use, 0 to scan every time the controller is idle.
+    unsigned maxScanInterval;   ///< Longest the scans back off to while the board is still, 0 to always scan every scanInterval.
+    unsigned currentInterval;   ///< Milliseconds between scans right now, scanInterval or backed off from it.
+    unsigned lastScan;
+    unsigned lastActive;        ///< When a scan last saw a change, or the board was last in use.
+    Bitboard squareState;       ///< Occupancy the board has taken in, or expects while a position is being set up. Squares where sensed differs are changes still to be handled.
+    Bitboard ledOn;             ///< LEDs that are lit, flashing ones included. Changing these changes what is displayed on the next idle.
+    Bitboard ledFlash;          ///< LEDs that flash.
+    const char* rowNames="87654321";
+    const char* colNames="abcdefgh";
+    thc::ChessPosition startPosition;   ///< Where the game started, set by setPosition().
+    vector<thc::Move> played;   ///< The moves played since startPosition.
+    unsigned stateVersion;      ///< Bumped when the game, the mode or the move being waited for changes, so it can be saved.
+    bool gameReported;          ///< onGameOver() was called for the game.
+    Histogram scanTime;         ///< One idle, reading every square and updating the LEDs.
+    Histogram rulesTime;        ///< Legal move generation when a piece is lifted, and checking and playing a move.
+
+    Board(int boardId,BoardListener* l,BoardIO* boardIO)
+            : id(boardId),listener(l),gameMode(MODE_PLAY),io(boardIO),sensed(0),sensedAt(0),scanInterval(0),maxScanInterval(0),currentInterval(0),lastScan(0),lastActive(0),
+              squareState(0),ledOn(0),ledFlash(0),stateVersion(0),gameReported(false) {}
+
+    /** Reads the sensors into sensed. */
+    void rescan() {
+        sensed = io->scan();
+        sensedAt = io->changedAt();
+        if(!sensedAt)
+            sensedAt = frameTime();
+    }
+
+    /**
+     * Runs the board for one tick, if its scan interval has passed. Between scans that have
+     * backed off, flashing LEDs are still flashed every tick.
+     */
+    void idle(unsigned now) {
+        if(currentInterval && now-lastScan < currentInterval) {
+            if(ledFlash && currentInterval > scanInterval) {
+                io->select();
+                flasher();
+            }
+            return;
+        }
+        lastScan = now;
+        if(io->ended() && io->restart())
+            initGame();
+        io->select();
+        bool changed=false;
+        int scans=0;
+        do {
+            uint64_t start = monotonicMicros();
+            Bitboard previous = sensed;
+            rescan();
+            changed |= sensed != previous;
+            switch(gameMode) {
+                case MODE_INSPECT: idleShowPieces(); break;
+                case MODE_PLAY: idlePlay(); break;
+                case MODE_MOVE: idleMove(); break;
+                case MODE_SETPOSITION: idleSetPosition(); break;
+            }
+            flasher();
+            scanTime.add(monotonicMicros()-start);
+        } while(io->backlog() && ++scans < MAX_SCANS_PER_IDLE);
+        schedule(now,changed);
+    }
+
+    /**
+     * True while the player is in the middle of something: a piece is lifted, or the board is
+     * waiting for a move, for a position to be set up, or showing the pieces.
+     */
+    bool inUse() {
+        return moveIndex || gameMode == MODE_MOVE || gameMode == MODE_SETPOSITION || gameMode == MODE_INSPECT;
+    }
+
+    /**
+     * Picks when to scan next. The board scans every scanInterval while it's in use and for
+     * STILL_MS after anything changes. After that the interval doubles with each scan, up to
+     * maxScanInterval, and the first change snaps it back.
+     */
+    void schedule(unsigned now,bool changed) {
+        if(changed || inUse())
+            lastActive = now;
+        if(!maxScanInterval || now-lastActive < STILL_MS) {
+            currentInterval = scanInterval;
+        } else if(currentInterval < maxScanInterval) {
+            currentInterval = currentInterval < FIRST_BACKOFF_MS ? FIRST_BACKOFF_MS : currentInterval*2;
+            if(currentInterval > maxScanInterval)
+                currentInterval = maxScanInterval;
+        }
+    }
+
+    /** Goes back to scanning every scanInterval, for when a command puts the board to use. */
+    void wake() {
+        currentInterval = scanInterval;
+        lastActive = lastScan;
+    }
+
+    void initGame() {
+        wake();
+        io->select();
+        rescan();
+        gameMode = MODE_PLAY;
+        LOG_INFO("board %d turning off led's",id);
+        clearLeds();
+        squareState = sensed;
+//        const char* fen = "8/8/8/8/8/K6k/8/8 w - - 0 1";    //two kings
+//        const char* fen = "8/8/8/8/4q3/1K2k3/8/8 w - - 0 1";  //a few pieces for testing
+        const char* fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"; //a new game. you can also just not set the fen on a new board instance
+        setPosition(fen);
+        display_position(rules);
+        if(!isBoardSetup()) {
+            LOG_INFO("board %d: setup your board as shown, white king on left, black king on right",id);
+        }
+    }
+
+
+    /** Turn on the specified LED. Example:
+     * echo '{"action":"led","square":"a2"}' | nc -C -N localhost 9999 */
+    void setLed(json& j,json& jresult) {
+        jresult["success"] = true;
+        string square = j["square"];
+        int index = toIndex(square.c_str());
+        LOG_DEBUG("board %d led square=%s index=%d",id,square.c_str(),index);
+        led(index,testBit(ledOn,index)?LED_OFF:LED_ON); //flip from on to off and off to on
+    }
+
+
+    const char* modeName(int mode) {
+        switch(mode) {
+            case MODE_SETUP: return "setup";
+            case MODE_INSPECT: return "inspect";
+            case MODE_PLAY: return "play";
+            case MODE_MOVE: return "move";
+            case MODE_SETPOSITION: return "setposition";
+            case MODE_MATE: return "mate";
+        }
+        return "unknown";
+    }
+
+
+    /**
+     * Occupancy the board has taken in. While it waits for a move or a position this is what it
+     * expects, not what it senses, see sensed for that.
+     */
+    Bitboard occupancy() {
+        return squareState;
+    }
+
+    void setPosition(const char* fen) {
+        gameOver();
+        gameReported = false;
+        rules.Forsyth(fen);
+        startPosition = rules;
+        played.clear();
+        resync();
+    }
+
+    /**
+     * Makes the board expect the pieces where the rules have them, after a move or when the
+     * player has moved pieces they shouldn't have. Works straight from the position rather
+     * than through a FEN, so the game's history, which repetition is detected from, is kept.
+     */
+    void resync() {
+        clearLeds();
+        squareState = rules.occupancy();
+        gameMode = isBoardSetup() ? MODE_PLAY:MODE_SETPOSITION;
+        stateVersion++;
+    }
+
+    /**
+     * Picks up a game restored from a saved state instead of starting a new one. If the pieces
+     * were moved while the controller was down, the player is asked to put them back.
+     */
+    void resume() {
+        wake();
+        io->select();
+        rescan();
+        gameReported = gameMode == MODE_MATE;
+        if(gameMode == MODE_INSPECT || gameMode == MODE_SETUP)
+            squareState = sensed;
+        else if(gameMode == MODE_PLAY && !isBoardSetup())
+            resync();
+        display_position(rules);
+        LOG_INFO("board %d resumed a game %u moves in, mode %s",id,(unsigned)played.size(),modeName(gameMode));
+    }
+    void setPosition(json& j,json& jresult) {
+        wake();
+        string fen = j["fen"];
+        setPosition(fen.c_str());
+        display_position(rules);
+        jresult["success"] = true;
+    }
+
+    void setMode(json& j,json& jresult) {
+        wake();
+        stateVersion++;
+        jresult["success"] = true;     //assume okay
+        if(j.count("mode")==1) {
+            string mode = j["mode"];
+            if(!mode.compare("play")) {
+                gameMode = MODE_PLAY;
+                jresult["message"] = "game mode set to MODE_PLAY";
+                clearLeds();
+            } else if(!mode.compare("setup")) {
+                gameMode = MODE_SETUP;
+                jresult["message"] = "game mode set to MODE_SETUP";
+                clearLeds();
+            } else if(!mode.compare("inspect")) {
+                gameMode = MODE_INSPECT;
+                jresult["message"] = "game mode set to MODE_INSPECT";
+                clearLeds();
+            } else {
+                jresult["message"] = "invalid mode";
+                jresult["success"] = false;
+            }
+        } else {
+            jresult["message"] = "mode must be specified";
+            jresult["success"] = false;
+        }
+    }
+
+    void clearLeds() {
+        ledOn = ledFlash = 0;
+    }
+
+    void turnOffLeds() {
+        io->select();
+        io->setLeds(0);
+    }
+
+    void doMove(json& j) {
+        wake();
+        stateVersion++;
+        ChessAction *ca = new ChessAction(j);
+        int index=0;
+        waitMove.setFrom(ca->move(index).fromIndex());
+        waitMove.setTo(ca->move(index).toIndex());
+        waitMove.setType(ca->move(index).type());
+        led(ca->move(index).fromIndex(),LED_ON);
+        led(ca->move(index).toIndex(),LED_ON);
+        gameMode = MODE_MOVE;
+        moveIndex = 0;
+        if(!strcmp(ca->move(index).type(),"capture")) {
+            moveType[0] = MOVE_UP;
+            moveType[1] = MOVE_UP;
+            moveType[2] = MOVE_DOWN;
+            moveSquareIndex[0] = ca->move(index).fromIndex();
+            moveSquareIndex[1] = ca->move(index).toIndex();
+            moveSquareIndex[2] = ca->move(index).toIndex();
+            movesNeeded = 3;
+        } else if(!strcmp(ca->move(index).type(),"takeback_capture")) {
+            moveType[0] = MOVE_UP;
+            moveType[1] = MOVE_DOWN;
+            moveType[2] = MOVE_DOWN;
+            moveSquareIndex[0] = ca->move(index).fromIndex();
+            moveSquareIndex[1] = ca->move(index).fromIndex();
+            moveSquareIndex[2] = ca->move(index).toIndex();
+            led(ca->move(index).fromIndex(),LED_FLASH);
+            movesNeeded = 3;
+        } else {
+            moveType[0] = MOVE_UP;
+            moveType[1] = MOVE_DOWN;
+            moveSquareIndex[0] = ca->move(index).fromIndex();
+            moveSquareIndex[1] = ca->move(index).toIndex();
+            movesNeeded = 2;
+        }
+
+        for(int i=0; i<4; i++) {
+            LOG_DEBUG("board %d type[%d]=%c square index=%d",id,i,moveType[i],moveSquareIndex[i]);
+        }
+
+        delete ca;
+    }
+
+
+    /** Returns a string like "a1". */
+    char* toMove(char* buffer, size_t n, char col, char row) {
+        snprintf(buffer, n, "%c%c", col, row);
+        return buffer;
+    }
+    char* toMove(char* buffer,size_t n,int index) {
+        snprintf(buffer,n,"%c%c",toCol(index),toRow(index));
+        return buffer;
+    }
+
+    /** Return the letter character of the column the index points to. The column should display before the row. */
+    char toCol(int index) {
+        int y = index/8;
+        int x = index-y*8;
+        return colNames[x];
+    }
+
+    /** Returns the number character of the row the index points to. You should use the column, then row. */
+    char toRow(int index) {
+        int y = index/8;
+        int x = index-y*8;
+        return rowNames[y];
+    }
+
+    /** Convert a string like "A1" into an index like 56, or "A8" to 0. Top left corner is 0, bottom right is 63. */
+    int toIndex(const char* square) {
+        int col=tolower(square[0])-'a';
+        int row=8-(square[1]-'0');
+//        printf("%s col=%d row=%d\n",square,col,row);
+        return row*8+col;
+    }
+
+    int toIndex(char col,char row) {
+        char buffer[SAN_BUF_SIZE];
+        toMove(buffer,sizeof(buffer),col,row);
+        return toIndex(buffer);
+    }
+
+
+    //Turns on the LEDs in ledOn, and flashes the ones in ledFlash
+    void flasher() {
+        flashState = !flashState;
+        io->setLeds(flashState ? ledOn : ledOn&~ledFlash);
+    }
+
+    void idleShowPieces() {
+        for(int i : Squares(sensed^squareState)) {
+            int state = readState(i);
+            LOG_INFO("board %d %c%c %s",id,toCol(i),toRow(i),(state ? "pieceDown" : "pieceUp"));
+            listener->onInspect(this,i,state);
+        }
+        squareState = sensed;
+        ledOn = sensed;
+        ledFlash = 0;
+    }
+
+    /**
+     * Turns on LEDs for any valid destination the piece at fromIndex can make.
+     *
+     * @param fromIndex Square that has the piece player is moving.
+     * @return true if there is at least one valid move, false otherwise.
+     */
+    bool showValidSquares(int fromIndex) {
+        char bufFrom[SAN_BUF_SIZE],bufTo[SAN_BUF_SIZE];
+        snprintf(bufFrom, sizeof(bufFrom), "%c%c", toCol(fromIndex), toRow(fromIndex));
+//        printf("Move from %s\n",bufFrom);
+
+        std::vector<thc::Move> moves;
+        std::vector<bool> check;
+        std::vector<bool> mate;
+        std::vector<bool> stalemate;
+        uint64_t start = monotonicMicros();
+        rules.GenLegalMoveList(moves, check, mate, stalemate);
+        rulesTime.add(monotonicMicros()-start);
+        unsigned int len = moves.size();
+        int validMoves=0;
+        clearLeds();
+        led(fromIndex,LED_ON);
+        for(int i=0; i<len; i++) {
+            thc::Move mv = moves[i];
+            std::string mv_txt = mv.TerseOut();
+//            printf("checking move %s > %s\n",mv_txt.c_str(),bufFrom);
+            if(mv_txt[0] == bufFrom[0] && mv_txt[1] == bufFrom[1]) {
+                int to=toIndex(mv_txt[2],mv_txt[3]);
+                led(to,1);
+                validMoves++;
+            }
+        }
+//        printf("number of valid moves %d\n",len);
+        return validMoves>0;
+    }
+
+    /** To long algebraic notation like "a2a3". */
+    char* toLAN(char* dest,size_t n,int from,int to) {
+        char bfrom[SAN_BUF_SIZE];
+        char bto[SAN_BUF_SIZE];
+        char bmove[SAN_BUF_SIZE];
+        toMove(bfrom,sizeof(bfrom),from);
+        toMove(bto,sizeof(bto),to);
+        snprintf(dest,n,"%s%s",bfrom,bto);
+        return dest;
+    }
+
+    /** Logs the position at debug level, where it's only rendered if debug is on. */
+    void display_position(thc::ChessRules& cr)
+    {
+        if(!Logger::instance().enabled(Logger::LEVEL_DEBUG))
+            return;
+        std::string fen = cr.ForsythPublish();
+        std::string s = cr.ToDebugStr();
+        LOG_DEBUG("board %d FEN = %s",id,fen.c_str());
+        LOG_DEBUG("board %d Position = %s",id,s.c_str());
+    }
+
+    /** Flash the king of the current player. */
+    void flashKingCheck() {
+        int index=0;
+        for(int i=0; i<64; i++) {
+            if((rules.pieceAt(i) == 'k' && !rules.WhiteToPlay()) || (rules.pieceAt(i) == 'K' && rules.WhiteToPlay())) {
+                index = i;
+                break;
+            }
+        }
+
+        long delay=100000;
+        turnOffLeds();  //force the leds off, instead of waiting for next idle call
+        io->delay(delay);
+        io->setLed(index,1);
+        io->delay(delay);
+        io->setLed(index,0);
+        io->delay(delay);
+        io->setLed(index,1);
+        io->delay(delay);
+        io->setLed(index,0);
+    }
+
+    /** Look to see if we are in checkmate, and set checkmated king's square to flash. */
+    void evaluateCheckMate() {
+        thc::TERMINAL terminal;
+        rules.Evaluate(terminal);
+        switch(terminal) {
+            case thc::TERMINAL::TERMINAL_BCHECKMATE: LOG_INFO("board %d black checkmate",id); break;
+            case thc::TERMINAL::TERMINAL_WCHECKMATE: LOG_INFO("board %d white checkmate",id); break;
+        }
+        if(terminal==thc::TERMINAL::TERMINAL_BCHECKMATE || terminal==thc::TERMINAL::TERMINAL_WCHECKMATE) {
+            gameMode=MODE_MATE;
+            stateVersion++;
+            for(int i=0; i<64; i++) {
+                if(rules.pieceAt(i) == 'k' && terminal == thc::TERMINAL::TERMINAL_BCHECKMATE)
+                    led(i,LED_FLASH);
+                else if(rules.pieceAt(i) == 'K' && terminal == thc::TERMINAL::TERMINAL_WCHECKMATE)
+                    led(i,LED_FLASH);
+            }
+            gameOver();
+        }
+    }
+
+    /** Tells the listener about the game, once, if any moves were played in it. */
+    void gameOver() {
+        if(gameReported || played.empty())
+            return;
+        gameReported = true;
+        listener->onGameOver(this);
+    }
+
+    /** Check if there is a draw. */
+    void evaluateDraw() {
+        //todo lee implement evaluate draw
+
+        //        thc::DRAWTYPE drawType;
+//        rules.IsDraw(rules.WhiteToPlay(),drawType);
+//        switch(drawType) {
+//            case thc::DRAWTYPE::DRAWTYPE_50MOVE: printf("DRAWTYPE_50MOVE\n"); break;
+//            case thc::DRAWTYPE::DRAWTYPE_INSUFFICIENT: printf("DRAWTYPE_INSUFFICIENT\n"); break;
+//            case thc::DRAWTYPE::DRAWTYPE_INSUFFICIENT_AUTO: printf("DRAWTYPE_INSUFFICIENT_AUTO\n"); break;
+//            case thc::DRAWTYPE::DRAWTYPE_REPITITION: printf("DRAWTYPE_DRAWTYPE_REPITITION"); break;
+//        }
+//        if(drawType != thc::DRAWTYPE::NOT_DRAW) {
+//            for(int i=0; i<64; i++) {
+//                if(rules.pieceAt(i) == 'k' || rules.pieceAt(i) == 'K')
+//                    led(i,LED_FLASH);
+//            }
+//        }
+    }
+
+    /** Piece was put down, now check what the move was. */
+    void finishMove(int toIndex) {
+        moveIndex = 0;
+        clearLeds();
+        if(toIndex != moveSquareIndex[0]) {
+            //this is a move, player didn't replace the piece on the square they lifted it off from
+            char buffer[SAN_BUF_SIZE];
+            toLAN(buffer, sizeof(buffer), moveSquareIndex[0], toIndex);
+            uint64_t start = monotonicMicros();
+            thc::Move mv;
+            mv.TerseIn(&rules, buffer);
+//            printf("full move is %s - %s\n", buffer,mv.NaturalOut(&rules).c_str());
+            if(!mv.Valid()) {
+                rulesTime.add(monotonicMicros()-start);
+                listener->onInvalidMove(this,moveSquareIndex[0],toIndex,mv.TerseOut().c_str(),mv.NaturalOut(&rules).c_str());
+                resync();
+                return;
+            }
+            string san = mv.NaturalOut(&rules).c_str();
+            bool kingChecked = rules.isCheck(mv);
+            bool capture = mv.NaturalOut(&rules).find('x')!=string::npos;
+            uint64_t rulesUs = monotonicMicros()-start;
+
+            listener->onMove(this,moveSquareIndex[0],toIndex,mv,san.c_str(),capture,kingChecked);
+            start = monotonicMicros();
+            rules.PlayMove(mv);
+            played.push_back(mv);
+            rulesTime.add(rulesUs+monotonicMicros()-start);
+            display_position(rules);
+            LOG_DEBUG("board %d san=%s kingChecked=%d",id,san.c_str(),kingChecked);
+            if(kingChecked) {
+                flashKingCheck();
+            }
+        }
+        resync();
+        evaluateCheckMate();
+        evaluateDraw();
+    }
+
+    void idlePlay() {
+        //check each square to see if its state has changed
+        Bitboard changed = sensed^squareState;
+        if(!changed)
+            return;
+        int i = firstSquare(changed);   //only process one square change at a time
+        int state = readState(i);
+        //state 0=piece lifted, 1=piece dropped
+        setBit(squareState,i,state);
+        listener->onPiece(this,i,state);
+        LOG_DEBUG("board %d state=%d moveIndex=%d",id,state,moveIndex);
+
+        if (!state && !moveIndex) {
+            //picked up first piece
+            LOG_DEBUG("board %d picked up first piece",id);
+            if(showValidSquares(i)) {
+                moveType[moveIndex] = MOVE_UP;
+                moveSquareIndex[moveIndex] = i;
+                moveIndex++;
+            } else {
+                //todo lee would like to be able to pick up the piece you are capturing first
+                LOG_INFO("board %d: you can't move that piece",id);
+                while(!readState(i) && !io->ended()) {
+                    io->delay(100000);
+                    io->setLed(i,1);
+                    io->delay(100000);
+                    io->setLed(i,0);
+                    io->delay(100000);
+                    io->setLed(i,1);
+                    io->delay(100000);
+                    io->setLed(i,0);
+                    io->delay(300000);
+                    rescan();
+                }
+                led(i,LED_OFF);
+                setBit(squareState,i,readState(i));
+                listener->onPiece(this,i,readState(i));
+                LOG_DEBUG("board %d state=%d moveIndex=%d",id,readState(i),moveIndex);
+            }
+        } else if(!state && moveIndex<2) {
+            //picked up another piece
+            LOG_DEBUG("board %d picked up a second piece",id);
+            moveType[moveIndex] = MOVE_UP;
+            moveSquareIndex[moveIndex] = i;
+            moveIndex++;
+            led(i, LED_ON);
+        } else if(!state && moveIndex>=2) {
+            //picked up more then 2 pieces
+            LOG_INFO("board %d picked up too many pieces",id);
+            resync();
+        } else if(state && !moveIndex) {
+            //piece down but no piece up, not valid
+            LOG_INFO("board %d put down a piece but none picked up",id);
+            resync();
+        } else if(state) {
+            //piece down
+            LOG_DEBUG("board %d put down piece",id);
+            moveType[moveIndex] = MOVE_DOWN;
+            moveSquareIndex[moveIndex] = i;
+            moveIndex++;
+            finishMove(i);
+        } else {
+            LOG_ERROR("board %d should not get here",id);
+            assert(false);
+        }
+    }
+
+    void idleMove() {
+        for(int i : Squares(sensed^squareState)) {
+            if(gameMode != MODE_MOVE)
+                break;
+            int state = readState(i);
+            char type = state ? MOVE_DOWN:MOVE_UP;
+            if(moveType[moveIndex] == type && moveSquareIndex[moveIndex] == i) {
+                LOG_DEBUG("board %d got move %d %c",id,moveIndex,moveType[moveIndex]);
+                bool resetLed = (moveIndex==1 && type==MOVE_UP) ? false:true;
+                if(resetLed)
+                    led(i,LED_OFF);
+                moveIndex++;
+                if(moveIndex == movesNeeded) {
+                    gameMode = MODE_PLAY;
+                    LOG_INFO("board %d move finished",id);
+                    listener->onMoveFinished(this);
+                    finishMove(moveSquareIndex[moveIndex-1]);
+                }
+                setBit(squareState,i,state);
+            } else {
+                setBit(squareState,i,state);    //onPiece reports the occupancy after the change
+                listener->onPiece(this,i,state);
+            }
+        }
+    }
+
+    /** Any squares that need a piece, will be solid. Any square that has a piece that should not
+     * will flash.
+     */
+    void idleSetPosition() {
+        //setup what it should look like
+        Bitboard extra = sensed&~squareState;
+        Bitboard missing = squareState&~sensed;
+        ledOn = extra|missing;
+        ledFlash = extra;
+        if(!extra && !missing) {
+            clearLeds();
+            gameMode = MODE_PLAY;
+            stateVersion++;
+            listener->onSetPositionComplete(this);
+        }
+    }
+
+    /** Checks if all squares have a piece that should, and the ones that should not are empty. */
+    bool isBoardSetup() {
+        return sensed == squareState;
+    }
+
+    /**
+     * Checks if a piece was detected on the given square by the last scan.
+     * @param index Square to check.
+     * @return 0 if empty, 1 if a piece is detected.
+     */
+    int readState(int index) {
+        return testBit(sensed,index);
+    }
+
+    // Return true if the square is occupied, false otherwise.
+    bool isSquareOccupied(int index) {
+        return testBit(squareState,index);
+    }
+
+    // Return true if the state given means the square is occupied, false otherwise
+    bool isStateOccupied(int state) {
+        return state==0;
+    }
+
+    /** Sets the LED state, doesn't actually turn on/off the led. LED_FLASH is LED_ON with the flash bit. */
+    void led(int index,int state) {
+        setBit(ledOn,index,state&LED_ON);
+        setBit(ledFlash,index,state&(LED_FLASH&~LED_ON));
+    }
+};
+
+#endif //CONTROLLER_BOARD_HPP
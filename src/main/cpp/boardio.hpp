@@ -0,0 +1,274 @@
+//
+// Where a board's sensor readings come from and its LED writes go.
+//
+
+#ifndef CONTROLLER_BOARDIO_HPP
+#define CONTROLLER_BOARDIO_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "log.hpp"
+
+/**
+ * The hardware side of a board. The board takes a scan of all 64 reed switches at once and
+ * works from that, so a backend only has to produce occupancy bitboards; this is what lets a
+ * capture be replayed, or a simulator stand in for the board.
+ */
+class BoardIO {
+public:
+    uint64_t busErrors;         ///< Failed bus transactions, for backends that have a bus.
+    uint64_t faultMask;         ///< Squares whose chip isn't answering. Scans report them as they were before the chip failed.
+
+    BoardIO() : busErrors(0),faultMask(0) {}
+    virtual ~BoardIO() {}
+
+    /** Gets the hardware ready. */
+    virtual void setup() {}
+
+    /** Makes this board the one on the bus, before the board scans or writes LEDs. */
+    virtual void select() {}
+
+    /** Reads every square, bit n set if square n (0=a8, 63=h1) has a piece on it. */
+    virtual uint64_t scan()=0;
+
+    /**
+     * Microseconds since the epoch when the last change the scan returned really happened, for
+     * backends that know better than the time of the scan. 0 means the scan time is as good
+     * as it gets.
+     */
+    virtual uint64_t changedAt() {
+        return 0;
+    }
+
+    /** Turns a square's LED on or off. */
+    virtual void setLed(int index,int on)=0;
+
+    /** Sets every LED at once, bit n lights square n. Backends that can write a row in one go override this. */
+    virtual void setLeds(uint64_t on) {
+        for(int i=0; i<64; i++) {
+            setLed(i,(on>>i)&1);
+        }
+    }
+
+    /** Waits, used when the board blinks LEDs at the player. Backends that aren't real time don't wait. */
+    virtual void delay(unsigned us) {
+        usleep(us);
+    }
+
+    /** True if there are more scans ready right away, so the board should scan again this tick. */
+    virtual bool backlog() {
+        return false;
+    }
+
+    /** True once a backend that plays something back has nothing more to play. */
+    virtual bool ended() {
+        return false;
+    }
+
+    /**
+     * Starts playing back from the beginning, for backends that loop. The board starts a new
+     * game when it does.
+     * @return false if the backend doesn't restart.
+     */
+    virtual bool restart() {
+        return false;
+    }
+};
+
+/** MCP23017 registers, with IOCON.BANK=0 as it is after power on. */
+enum {
+    MCP_IODIRA  = 0x00,
+    MCP_IODIRB  = 0x01,
+    MCP_IOCON   = 0x0a,
+    MCP_GPPUA   = 0x0c,
+    MCP_GPIOA   = 0x12,
+    MCP_OLATB   = 0x15
+};
+
+/**
+ * A board of eight MCP23017 chips, one per row, at addresses 0x20 to 0x27. Reed switches are
+ * on bank A and LEDs on bank B. Several boards can share the bus when each sits behind its own
+ * channel of a TCA9548A multiplexer.
+ *
+ * This holds what doesn't depend on how the bus is driven: keeping track of each chip's health.
+ * A read that fails is retried a couple of times. A chip that still fails is marked down and
+ * its row masked (see faultMask), so a flaky row reads as it did before rather than as eight
+ * lifted pieces. A down chip is tried again after 1, 2, 4 ... up to MAX_BACKOFF scans, and is
+ * configured again before it is read, since a chip that browned out has lost its settings. A
+ * chip that resets without ever failing a read is caught by checking one chip's IODIRB every
+ * CHECK_SCANS scans.
+ */
+class McpBoardIO : public BoardIO {
+public:
+    enum {ROWS=8,FIRST_CHIP=0x20};
+    enum {RETRIES=2,RETRY_DELAY_US=100,MAX_BACKOFF=128,CHECK_SCANS=500};
+
+    struct ChipHealth {
+        bool up;
+        unsigned retryIn;       ///< Scans until a down chip is tried again.
+        unsigned backoff;       ///< What retryIn is set to the next time the chip fails.
+        uint64_t failures;      ///< Reads that failed even after retrying.
+        uint64_t reinits;       ///< Times the chip was configured again after failing or losing its settings.
+    };
+
+    int muxAddress;             ///< Address of the TCA9548A the board is behind, 0 if it is wired straight to the bus.
+    int muxChannel;
+    bool swap;
+    ChipHealth chips[ROWS];
+
+protected:
+    uint64_t m_occupancy;       ///< Last scan, down rows hold their last good reading.
+    uint64_t m_scans;
+
+    /** Reads GPIOA of every chip, for backends that can do that in one go. false if any chip failed. */
+    virtual bool readAll(uint8_t* inputs) {
+        return false;
+    }
+    /** Reads GPIOA of one chip. */
+    virtual bool readRow(int row,uint8_t& inputs)=0;
+    /** Sets a chip's bank A to inputs with pull ups and bank B to outputs. */
+    virtual bool configureRow(int row)=0;
+    /** Reads a register of one chip. */
+    virtual bool readRegister(int row,uint8_t reg,uint8_t& value)=0;
+
+    /**
+     * True if a chip is already set up the way configureRow() sets it, as it is when the
+     * controller restarts without the board losing power.
+     */
+    virtual bool isConfigured(int row) {
+        uint8_t iodira,iodirb,gppua;
+        return readRegister(row,MCP_IODIRA,iodira) && readRegister(row,MCP_IODIRB,iodirb) && readRegister(row,MCP_GPPUA,gppua)
+                && iodira == 0xff && iodirb == 0 && gppua == 0xff;
+    }
+
+    /**
+     * Configures the chips that need it.
+     * @param skipConfigured Leave out the ones that kept their settings, false configures every chip.
+     */
+    void configureChips(bool skipConfigured=true) {
+        int skipped=0;
+        for(int row=0; row<ROWS; row++) {
+            if(skipConfigured && isConfigured(row)) {
+                skipped++;
+            } else if(!configureRow(row)) {
+                LOG_ERROR("no MCP23017 at 0x%02x (mux 0x%02x channel %d)",FIRST_CHIP+row,muxAddress,muxChannel);
+                chipFailed(row);
+            }
+        }
+        if(skipConfigured)
+            LOG_INFO("mux 0x%02x channel %d: %d of %d chips were already configured",muxAddress,muxChannel,skipped,ROWS);
+    }
+
+    bool readRowRetrying(int row,uint8_t& inputs) {
+        unsigned delay=RETRY_DELAY_US;
+        for(int attempt=0; attempt<=RETRIES; attempt++) {
+            if(attempt) {
+                usleep(delay);
+                delay *= 2;
+            }
+            if(readRow(row,inputs))
+                return true;
+        }
+        return false;
+    }
+
+    void chipFailed(int row) {
+        ChipHealth& chip = chips[row];
+        chip.failures++;
+        if(chip.up)
+            LOG_WARN("chip 0x%02x (mux 0x%02x channel %d) isn't answering, ignoring rank %d",FIRST_CHIP+row,muxAddress,muxChannel,8-row);
+        chip.up = false;
+        chip.retryIn = chip.backoff;
+        chip.backoff = chip.backoff*2 > MAX_BACKOFF ? MAX_BACKOFF : chip.backoff*2;
+    }
+
+    void chipAnswered(int row) {
+        ChipHealth& chip = chips[row];
+        if(!chip.up)
+            LOG_INFO("chip 0x%02x (mux 0x%02x channel %d) is back, reading rank %d again",FIRST_CHIP+row,muxAddress,muxChannel,8-row);
+        chip.up = true;
+        chip.retryIn = 0;
+        chip.backoff = 1;
+    }
+
+    /** Reads one chip, bringing it back first if it was down and it's time to try it again. */
+    bool scanRow(int row,uint8_t& inputs) {
+        ChipHealth& chip = chips[row];
+        if(!chip.up) {
+            if(chip.retryIn && --chip.retryIn)
+                return false;
+            chip.reinits++;
+            if(!configureRow(row)) {
+                chipFailed(row);
+                return false;
+            }
+        }
+        if(!readRowRetrying(row,inputs)) {
+            chipFailed(row);
+            return false;
+        }
+        chipAnswered(row);
+        return true;
+    }
+
+    /** Makes sure one chip, a different one each time, still has its settings. */
+    void checkRow(int row) {
+        uint8_t iodirb;
+        if(!chips[row].up || !readRegister(row,MCP_IODIRB,iodirb) || iodirb == 0)
+            return;
+        LOG_WARN("chip 0x%02x (mux 0x%02x channel %d) lost its settings, configuring it again",FIRST_CHIP+row,muxAddress,muxChannel);
+        chips[row].reinits++;
+        if(!configureRow(row))
+            chipFailed(row);
+    }
+
+    bool allUp() {
+        for(int row=0; row<ROWS; row++) {
+            if(!chips[row].up)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    McpBoardIO(int mux,int channel,bool swapWiring)
+            : muxAddress(mux),muxChannel(channel),swap(swapWiring),m_occupancy(0),m_scans(0) {
+        for(int row=0; row<ROWS; row++) {
+            ChipHealth health = {true,0,1,0,0};
+            chips[row] = health;
+        }
+    }
+
+    uint64_t scan() {
+        uint8_t inputs[ROWS];
+        bool read[ROWS];
+        bool all = allUp() && readAll(inputs);
+        for(int row=0; row<ROWS; row++)
+            read[row] = all || scanRow(row,inputs[row]);
+        if(++m_scans%CHECK_SCANS == 0)
+            checkRow(m_scans/CHECK_SCANS%ROWS);
+
+        uint64_t bits=m_occupancy;
+        faultMask=0;
+        for(int row=0; row<ROWS; row++) {
+            uint64_t rowMask = 0xffULL<<(row*8);
+            if(!read[row]) {
+                faultMask |= rowMask;
+                continue;
+            }
+            uint8_t occupied = (uint8_t)~inputs[row];     //the switch pulls the pin low when there is a piece
+            if(swap && row == 4) {
+                // I messed up my wiring, so this fixes it
+                uint8_t a = occupied>>3&1, b = occupied>>4&1;
+                occupied = (uint8_t)((occupied&~0x18) | b<<3 | a<<4);
+            }
+            bits = (bits&~rowMask) | (uint64_t)occupied<<(row*8);
+        }
+        m_occupancy = bits;
+        return bits;
+    }
+};
+
+#endif //CONTROLLER_BOARDIO_HPP
@@ -0,0 +1,247 @@
+//
+// Recording every sensor scan to a file, and playing such a file back instead of the board.
+//
+
+#ifndef CONTROLLER_CAPTURE_HPP
+#define CONTROLLER_CAPTURE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "boardio.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+#define CAPTURE_MAGIC "CLRC"
+#define CAPTURE_VERSION 1
+
+/**
+ * A capture file is an 8 byte header, "CLRC", a u8 version and 3 reserved bytes, followed by
+ * one record per scan:
+ *
+ * ```
+ * varint board     id of the board that was scanned
+ * varint delta     microseconds since the previous record in the file
+ * varint changed   occupancy xor the board's previous occupancy (0 before its first record)
+ * ```
+ *
+ * Varints are little endian base 128, 7 bits per byte with the top bit set on every byte but
+ * the last. A scan where nothing changed is 3 bytes, so a board scanned every 10ms takes about
+ * 1MB an hour.
+ */
+inline void putVarint(string& out,uint64_t v) {
+    while(v >= 0x80) {
+        out += (char)(v|0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+/**
+ * Reads a varint at pos, moving pos past it.
+ * @return false if the data ends in the middle of it.
+ */
+inline bool getVarint(const string& in,size_t& pos,uint64_t& v) {
+    v = 0;
+    for(int shift=0; shift<64 && pos<in.size(); shift+=7) {
+        unsigned char c = in[pos++];
+        v |= (uint64_t)(c&0x7f)<<shift;
+        if(!(c&0x80))
+            return true;
+    }
+    return false;
+}
+
+/** Appends records to a capture file. Writes are buffered and go to the file on flush(). */
+class CaptureWriter {
+protected:
+    FILE* m_file;
+    string m_buffer;
+    uint64_t m_last;                ///< Time of the previous record.
+    vector<uint64_t> m_previous;    ///< Last occupancy of each board.
+
+public:
+    enum {FLUSH_SIZE=64*1024};
+
+    CaptureWriter() : m_file(NULL),m_last(0) {}
+    ~CaptureWriter() {
+        if(m_file) {
+            flush();
+            fclose(m_file);
+        }
+    }
+
+    bool open(const char* path) {
+        m_file = fopen(path,"wb");
+        if(!m_file) {
+            perror(path);
+            return false;
+        }
+        char header[8] = {'C','L','R','C',CAPTURE_VERSION,0,0,0};
+        fwrite(header,sizeof(header),1,m_file);
+        m_last = monotonicMicros();
+        return true;
+    }
+
+    void add(int board,uint64_t occupancy) {
+        if((int)m_previous.size() <= board)
+            m_previous.resize(board+1,0);
+        uint64_t now = monotonicMicros();
+        putVarint(m_buffer,board);
+        putVarint(m_buffer,now-m_last);
+        putVarint(m_buffer,occupancy^m_previous[board]);
+        m_last = now;
+        m_previous[board] = occupancy;
+        if(m_buffer.size() >= FLUSH_SIZE)
+            flush();
+    }
+
+    void flush() {
+        if(m_buffer.empty())
+            return;
+        fwrite(m_buffer.data(),m_buffer.size(),1,m_file);
+        fflush(m_file);
+        m_buffer.clear();
+    }
+};
+
+/** Records every scan of the board it wraps, and otherwise behaves just like it. */
+class RecordingIO : public BoardIO {
+protected:
+    BoardIO* m_io;
+    CaptureWriter* m_writer;
+    int m_board;
+
+public:
+    RecordingIO(BoardIO* io,CaptureWriter* writer,int board) : m_io(io),m_writer(writer),m_board(board) {}
+    ~RecordingIO() {
+        delete m_io;
+    }
+
+    void setup() {m_io->setup();}
+    void select() {m_io->select();}
+    void setLed(int index,int on) {m_io->setLed(index,on);}
+    void setLeds(uint64_t on) {m_io->setLeds(on);}
+    void delay(unsigned us) {m_io->delay(us);}
+    uint64_t changedAt() {return m_io->changedAt();}
+    bool backlog() {return m_io->backlog();}
+    bool ended() {return m_io->ended();}
+    bool restart() {return m_io->restart();}
+
+    uint64_t scan() {
+        uint64_t occupancy = m_io->scan();
+        busErrors = m_io->busErrors;
+        faultMask = m_io->faultMask;
+        m_writer->add(m_board,occupancy);
+        return occupancy;
+    }
+};
+
+/**
+ * A capture file loaded for playback. Records are played at their recorded times multiplied
+ * by 1/speed, or as fast as the boards take them with a speed of 0.
+ */
+class Replay {
+public:
+    struct Scan {
+        uint64_t time;          ///< Microseconds since the start of the capture.
+        uint64_t occupancy;
+    };
+
+    vector< vector<Scan> > boards;  ///< The scans of each board, in order.
+    double speed;
+    uint64_t started;               ///< monotonicMicros() of the first scan played back, 0 before.
+
+    Replay() : speed(1),started(0) {}
+
+    bool load(const char* path) {
+        FILE* file = fopen(path,"rb");
+        if(!file) {
+            perror(path);
+            return false;
+        }
+        string data;
+        char buffer[4096];
+        size_t n;
+        while((n = fread(buffer,1,sizeof(buffer),file)) > 0)
+            data.append(buffer,n);
+        fclose(file);
+        if(data.size() < 8 || data.compare(0,4,CAPTURE_MAGIC) || data[4] != CAPTURE_VERSION) {
+            fprintf(stderr,"%s is not a capture file\n",path);
+            return false;
+        }
+        size_t pos=8;
+        uint64_t time=0;
+        uint64_t board,delta,changed;
+        while(pos < data.size()) {
+            if(!getVarint(data,pos,board) || !getVarint(data,pos,delta) || !getVarint(data,pos,changed) || board > 255) {
+                LOG_WARN("%s is truncated, replaying the complete records",path);
+                break;
+            }
+            time += delta;
+            if(boards.size() <= board)
+                boards.resize(board+1);
+            Scan scan;
+            scan.time = time;
+            scan.occupancy = changed^(boards[board].empty() ? 0 : boards[board].back().occupancy);
+            boards[board].push_back(scan);
+        }
+        return true;
+    }
+
+    /** True if a scan recorded at time should be played now. */
+    bool due(uint64_t time) {
+        if(speed <= 0)
+            return true;
+        if(!started)
+            started = monotonicMicros();
+        return (monotonicMicros()-started)*speed >= time;
+    }
+};
+
+/** Plays back one board's scans from a Replay. LED writes go nowhere. */
+class ReplayIO : public BoardIO {
+protected:
+    Replay* m_replay;
+    int m_board;
+    size_t m_next;
+    uint64_t m_occupancy;
+
+public:
+    ReplayIO(Replay* replay,int board) : m_replay(replay),m_board(board),m_next(0),m_occupancy(0) {}
+
+    /** Each scan plays the next record, once it is due. Until then it repeats the last one. */
+    uint64_t scan() {
+        vector<Replay::Scan>& scans = m_replay->boards[m_board];
+        if(m_next < scans.size() && m_replay->due(scans[m_next].time)) {
+            m_occupancy = scans[m_next++].occupancy;
+            if(m_next == scans.size())
+                LOG_INFO("board %d replay finished after %u scans",m_board,(unsigned)m_next);
+        }
+        return m_occupancy;
+    }
+
+    void setLed(int index,int on) {}
+    void setLeds(uint64_t on) {}
+
+    void delay(unsigned us) {
+        if(m_replay->speed > 0)
+            usleep((useconds_t)(us/m_replay->speed));
+    }
+
+    bool backlog() {
+        vector<Replay::Scan>& scans = m_replay->boards[m_board];
+        return m_next < scans.size() && m_replay->due(scans[m_next].time);
+    }
+
+    bool ended() {
+        return m_next >= m_replay->boards[m_board].size();
+    }
+};
+
+#endif //CONTROLLER_CAPTURE_HPP
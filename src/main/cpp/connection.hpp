@@ -0,0 +1,85 @@
+//
+// Per client state the controller keeps for every connected client.
+//
+
+#ifndef CONTROLLER_CONNECTION_HPP
+#define CONTROLLER_CONNECTION_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+/** Event topics a client can subscribe to. Each broadcast event belongs to exactly one topic. */
+enum {
+    TOPIC_PIECE_UP      = 0x01,
+    TOPIC_PIECE_DOWN    = 0x02,
+    TOPIC_MOVE          = 0x04,
+    TOPIC_INVALID_MOVE  = 0x08,
+    TOPIC_SETPOSITION   = 0x10,
+    TOPIC_ALL           = 0xff
+};
+
+/**
+ * Converts a topic name, which is the action name of the events in that topic
+ * like "pieceUp" or "move", into its topic bit. "all" selects every topic.
+ *
+ * @return The topic bit, or 0 if the name isn't a known topic.
+ */
+inline unsigned topicFromName(const string& name) {
+    if(!name.compare("pieceUp")) return TOPIC_PIECE_UP;
+    if(!name.compare("pieceDown")) return TOPIC_PIECE_DOWN;
+    if(!name.compare("move")) return TOPIC_MOVE;
+    if(!name.compare("invalid_move")) return TOPIC_INVALID_MOVE;
+    if(!name.compare("setposition")) return TOPIC_SETPOSITION;
+    if(!name.compare("all")) return TOPIC_ALL;
+    return 0;
+}
+
+/**
+ * A connected client. Subclasses know how to get bytes to the client, this
+ * holds what the controller needs to know about it, like which events it wants.
+ */
+class Connection {
+public:
+    unsigned topics;        ///< Bitmask of TOPIC_* the client receives. New clients get everything.
+    bool binary;            ///< Client asked for binary frames (binaryprotocol.hpp) instead of json lines.
+    bool binaryNext;        ///< Protocol picked by a hello, takes effect once the hello has been replied to.
+    int diffBoard;          ///< Board the diffs are for.
+    unsigned diffInterval;  ///< Milliseconds between occupancy/LED diffs, 0 if the client isn't streaming them.
+    unsigned diffLast;      ///< When the last diff was checked for.
+    uint64_t diffOccupancy; ///< Occupancy bitboard the client was last sent.
+    uint64_t diffLeds;      ///< LED on bitboard the client was last sent.
+    uint64_t diffFlash;     ///< LED flash bitboard the client was last sent.
+
+    Connection() : topics(TOPIC_ALL),binary(false),binaryNext(false),diffBoard(0),diffInterval(0),diffLast(0),diffOccupancy(0),diffLeds(0),diffFlash(0) {}
+    virtual ~Connection() {}
+
+    /** Sends the bytes as is, the caller includes any line terminator. */
+    virtual void write(const char* buffer,size_t n)=0;
+
+    /** Bytes written but not sent to the client yet, if the connection keeps track. */
+    virtual size_t queued() {
+        return 0;
+    }
+
+    /**
+     * Sends a broadcast event, rendered as a terminated json line and as a binary frame. The
+     * same strings go to every client, so connections that need to wrap them can cache the
+     * result by seq instead of redoing the work for each client.
+     */
+    virtual void sendEvent(unsigned long seq,const string& line,const string& frame) {
+        if(binary)
+            write(frame.c_str(),frame.size());
+        else
+            write(line.c_str(),line.size());
+    }
+
+    /** True if the client is subscribed to the topic. */
+    bool wants(unsigned topic) {
+        return (topics&topic) != 0;
+    }
+};
+
+#endif //CONTROLLER_CONNECTION_HPP
@@ -47,6 +47,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <map>
+#include <vector>
+#include <thread>
 #include <error.h>
 #include <ssobjects/ssobjects.h>
 #include <ssobjects/simpleserver.h>
@@ -58,6 +61,25 @@
 #include "thc.h"
 #include "chessmove.hpp"
 #include "chessaction.hpp"
+#include "eventring.hpp"
+#include "connection.hpp"
+#include "eventencoder.hpp"
+#include "binaryprotocol.hpp"
+#include "listener.hpp"
+#include "shmring.hpp"
+#include "websocket.hpp"
+#include "board.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "boardio.hpp"
+#include "wiringpiio.hpp"
+#include "capture.hpp"
+#include "simulator.hpp"
+#include "i2cdev.hpp"
+#include "statefile.hpp"
+#include "journal.hpp"
+#include "gamedb.hpp"
+#include "explorer.hpp"
 
 #define TITLE "ChessLR"
 #define VERSION "0.1.0"
@@ -72,113 +94,117 @@ using namespace std;
 using namespace nlohmann;   //trying this
 
 
-#define MOVE_UP 'U'
-#define MOVE_DOWN 'D'
-#define MOVE_NONE '_'
 
-#define LED_OFF 0
-#define LED_ON 1
-#define LED_FLASH 3
-
-#define SAN_BUF_SIZE 6      ///< Minimum buffer size to hold a san or long san move. Something like long "h7h8q" or san "h8=Q+"
-
-class BoardRules : public thc::ChessRules {
+/** A client connected to the telnet port. */
+class TelnetConnection : public Connection {
+protected:
+    TelnetServerSocket* m_socket;
 public:
-    char pieceAt(int i) {
-        return squares[i];
-    }
-
-    /**
-     * Returns true if the move is a checking move (ends with '+'. Note
-     * you should do the check before calling PlayMove.
-     *
-     * @param mv Move before it is played.
-     * @return true if it is a check, false otherwise.
-     */
-    bool isCheck(thc::Move mv) {
-        return mv.NaturalOut(this).find_first_of('+') == string::npos ? false:true;
+    TelnetConnection(TelnetServerSocket* psocket) : Connection(),m_socket(psocket) {}
+    void write(const char* buffer,size_t n) {
+        m_socket->send(buffer,n);
     }
 };
-class ControllerServer : public TelnetServer {
+
+class ControllerServer : public TelnetServer, public CommandHandler, public BoardListener, public MetricsSource {
 public:
-    enum {MODE_SETUP,MODE_INSPECT,MODE_PLAY,MODE_MOVE,MODE_SETPOSITION,MODE_MATE};
-
-    BoardRules rules;
-    int gameMode;
-    int flashState=0;
-    ChessMove waitMove;         ///< The move the board is waiting for the player to complete.
-    char moveType[4]= {'_','_','_','_'};
-    int moveSquareIndex[4]={-1,-1,-1,-1};
-    int moveIndex=0;            ///< Zero indicates not pointing at anything.
-    int movesNeeded=0;
     enum {FREQ=10};
-    int devId;
-    int index;
-    int baseInput;
-    int baseOutput;
-    int input[64];              ///< Pin map for input. You use in your digitalRead calls like **digitalRead(input[squareIndex])**.
-    int output[64];             ///< Pin map for output. You use in your digitalWrite calls digitalWrite(output[squareIndex],state);. 1=on, 0=off.
-    int squareState[64];        ///< What the board is currently seeing. When a piece is lifted or dropped, this gets updated. 0=empty, 1=occupied
-    int ledState[64];           ///< What the LEDs are displaying. If you change this, it will immediately change what is displayed.
-    const char* rowNames="87654321";
-    const char* colNames="abcdefgh";
-    int mcp[8];
-
-    /** Sets up hardware and socket binding. */
-    ControllerServer(SockAddr& saBind,bool swap) : TelnetServer(saBind,FREQ){
-        devId=0x20;
-        index=0;
-        baseInput=250-64*2;
-        baseOutput=baseInput+8;
-
-        wiringPiSetup();
-
-        for(int row = 0; row<8; ++row) {
-            mcp[row]=mcp23017Setup(baseInput,devId+row);
-            if(mcp[row]<0)
-                perror("wiringPiI2CSetup");
+    vector<Board*> boards;      ///< The boards, a board's id is its index. Commands go to board 0 unless they say otherwise.
+    vector<Board*> starting;    ///< Boards whose hardware is still being set up, they join boards when it's done.
+    std::thread hardware;       ///< Sets up the hardware while the server starts accepting clients.
+    bool hardwareReady;         ///< Set by the hardware thread when it's done.
+    uint64_t launchedAt;        ///< monotonicMicros() when the controller started, for the startup times.
+    bool loopStarted;           ///< The server loop has made its first pass.
+    EventRing events;           ///< Recent broadcasts, so reconnecting clients can resume where they left off.
+    vector<Connection*> clients;    ///< Everyone connected, on any listener, with their subscriptions.
+    map<TelnetServerSocket*,Connection*> telnetClients;     ///< The clients on the telnet port, by socket.
+    UnixLineListener local;     ///< Optional unix domain socket for clients on the same machine.
+    ShmRing shm;                ///< Optional shared memory copy of the events and board state for local readers.
+    WebSocketListener ws;       ///< Optional WebSocket port for browsers.
+    EventEncoder encoder;       ///< Renders broadcast events, reused for every event.
+    FrameEncoder frames;        ///< Renders the same events for binary clients.
+    Metrics metrics;
+    MetricsListener metricsPort;    ///< Optional Prometheus scrape port.
+
+    enum {PENDING_MOVE,PENDING_SETPOSITION};
+    /** A command whose completion is sent to the client later, when the player has done it. */
+    struct PendingOp {
+        json id;                    ///< The id the client gave the command.
+        Connection* conn;
+        Board* board;
+        int kind;                   ///< PENDING_MOVE or PENDING_SETPOSITION
+        unsigned deadline;          ///< millis() when it times out, 0 for never.
+    };
+    vector<PendingOp> pending;  ///< At most one of each kind, a new command supersedes the old one.
+    CaptureWriter* capture;     ///< Records every scan when not NULL.
+    unsigned captureFlushed;
+    StateFile* state;           ///< Saves the games so they carry on after a restart, when not NULL.
+    Journal* journal;           ///< Records every move and position the boards accept, when not NULL.
+    GameDb* games;              ///< Keeps the finished games, when not NULL.
+    ExplorerTable* explorerTable;   ///< Move statistics built by chesslrindex, when not NULL.
+
+    /** Sets up socket binding. The boards are added with addBoard. */
+    ControllerServer(SockAddr& saBind,uint64_t launched)
+            : TelnetServer(saBind,FREQ),hardwareReady(false),launchedAt(launched),loopStarted(false),local(this),ws(this),
+              metricsPort(this,this),capture(NULL),captureFlushed(0),state(NULL),journal(NULL),games(NULL),explorerTable(NULL) {
+    }
 
-            for(int col=0; col<8; col++) {
-                int inputCol = col;
-                int outputCol = 7-col;
-                pinMode(baseInput+inputCol,INPUT);
-                pullUpDnControl(baseInput+inputCol,PUD_UP);
-                pinMode(baseOutput+outputCol,OUTPUT);
+    ~ControllerServer() {
+        if(hardware.joinable())
+            hardware.join();
+    }
 
-                input[index]=baseInput+inputCol;
-                output[index]=baseOutput+outputCol;
+    /**
+     * Adds a board. The board is numbered in the order it is added. Its hardware is set up by
+     * startHardware(). If a capture is being recorded, the board's scans are recorded too.
+     */
+    Board* addBoard(BoardIO* io) {
+        int id = boards.size()+starting.size();
+        if(capture)
+            io = new RecordingIO(io,capture,id);
+        Board* board = new Board(id,this,io);
+        starting.push_back(board);
+        return board;
+    }
 
-                ++index;
-            }
-            baseInput+=16;
-            baseOutput+=16;
-        }
+    /**
+     * Sets up the hardware of the boards on a thread of its own, so the server can start
+     * accepting clients meanwhile. The boards share the bus, so they're set up one after the
+     * other. Until they're done, commands for a board are answered with an error, the rest
+     * work as usual.
+     */
+    void startHardware() {
+        hardware = std::thread([this]() {
+            uint64_t start = monotonicMicros();
+            for(auto board : starting)
+                board->io->setup();
+            LOG_INFO("hardware set up in %.1f ms",(monotonicMicros()-start)/1000.0);
+            __atomic_store_n(&hardwareReady,true,__ATOMIC_RELEASE);
+        });
+    }
 
-        if(swap) {
-            // I messed up my wiring, so this fixes it
-            int i=8*4+3;
-            int t=input[i];
-            input[i]=input[i+1];
-            input[i+1]=t;
-        }
+    /**
+     * Moves the boards over to boards once their hardware is set up.
+     * @return true if there are no boards left starting.
+     */
+    bool hardwareStarted() {
+        if(starting.empty())
+            return true;
+        if(!__atomic_load_n(&hardwareReady,__ATOMIC_ACQUIRE))
+            return false;
+        hardware.join();
+        boards.insert(boards.end(),starting.begin(),starting.end());
+        starting.clear();
+        return true;
     }
 
-    void initGame() {
-        memset(squareState,0,sizeof(squareState));
-        gameMode = MODE_PLAY;
-        printf("Turning off led's...\n");
-        clearLeds();
-        for(int i=0; i<64; i++) {
-            squareState[i] = readState(i); //0=empty 1=occupied
-        }
-//        const char* fen = "8/8/8/8/8/K6k/8/8 w - - 0 1";    //two kings
-//        const char* fen = "8/8/8/8/4q3/1K2k3/8/8 w - - 0 1";  //a few pieces for testing
-        const char* fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"; //a new game. you can also just not set the fen on a new board instance
-        setPosition(fen);
-        display_position(rules);
-        if(!isBoardSetup()) {
-            printf("Setup your board as shown, white king on left, black king on right\n");
-        }
+    /** The board the command is for, from its optional "board" id, or NULL if there is no such board. */
+    Board* boardFor(json& j) {
+        if(!j.contains("board"))
+            return boards.empty() ? NULL : boards[0];
+        if(!j["board"].is_number_unsigned() || j["board"] >= boards.size())
+            return NULL;
+        return boards[j["board"].get<size_t>()];
     }
 
     void processSingleMsg(PacketMessage* pmsg)
@@ -189,589 +215,866 @@ public:
         {
             //One way to handle the message. Process and reply within the switch.
             case PacketBuffer::pcNewConnection:   onConnection(pmsg);               break;
-            case PacketBuffer::pcClosed:          printf("Connection closed.\n");   break;
+            case PacketBuffer::pcClosed:          onClosed(pmsg);                   break;
             case TelnetServerSocket::pcFullLine:  onFullLine(pmsg);                 break;
         }
         DELETE_NULL(ppacket);   //IMPORTANT! The packet is no longer needed. You must delete it.
     }
 
-    ChessAction* parseJson(const char* s) {
-        json j = json::parse(s);
-        printf("parseJson creating chess action\n");
-        ChessAction* c = new ChessAction(j);
-        return c;
-    }
-
+    /**
+     * A line holds either one command object, or an array of them. The commands in an array are
+     * run in order, with nothing else (scans, other clients) in between, stopping at the first
+     * one that fails. The results come back as one array in the same order. Clients don't
+     * need to wait for a reply before sending the next line, replies are always sent in the
+     * order the lines were received.
+     */
     void onFullLine(PacketMessage* pmsg)
     {
         TelnetServerSocket* psocket = (TelnetServerSocket*)pmsg->socket();
-        char* pszString = (char*)pmsg->packet()->getBuffer();
-        printf("Got from client: [%s]\n",pszString);
+        onLine(telnetClients[psocket],(char*)pmsg->packet()->getBuffer());
+    }
+
+    void onLine(Connection* conn,char* pszString)
+    {
+        LOG_DEBUG("got from client: [%s]",pszString);
 
         try {
             json j = json::parse(pszString);
-            json jresult;
-            jresult["success"]=false;
-            jresult["code"]=nullptr;
-            jresult["message"]=nullptr;
-            if(j.contains("action")) {
-                string action = j["action"];
-                printf("parsed and have action = %s\n", action.c_str());
-                if (!action.compare("move")) {
-                    doMove(psocket, pszString);
-                    psocket->println(jresult.dump().c_str());
-                } else if (!action.compare("ping")) {
-                    psocket->println("pong");
-                    psocket->println(jresult.dump().c_str());
-                } else if (!action.compare("setmode")) {
-                    setMode(j, jresult);
-                    psocket->println(jresult.dump().c_str());
-                } else if (!action.compare("led")) {
-                    setLed(j, jresult);
-                    psocket->println(jresult.dump().c_str());
-                } else if (!action.compare("setposition")) {
-                    setPosition(j, jresult);
-                    psocket->println(jresult.dump().c_str());
+            if(j.is_array()) {
+                json jresults = json::array();
+                bool failed=false;
+                for(auto& command : j) {
+                    json jresult = newResult();
+                    if(failed) {
+                        jresult["message"] = "skipped";
+                    } else {
+                        if(!dispatch(conn, command, jresult))
+                            jresult["message"] = "unknown action";
+                        failed = !jresult["success"];
+                    }
+                    jresults.push_back(jresult);
                 }
+                reply(conn,jresults.dump());
+            } else {
+                json jresult = newResult();
+                if(dispatch(conn, j, jresult))
+                    reply(conn,jresult.dump());
             }
-
+            conn->binary = conn->binaryNext;  //a hello is replied to in the old protocol
         } catch(json::parse_error& e) {
-            psocket->println("json parse error: %s",e.what());
+            reply(conn,string("json parse error: ")+e.what());
         }
     }
 
-    /** Turn on the specified LED. Example:
-     * echo '{"action":"led","square":"a2"}' | nc -C -N localhost 9999 */
-    void setLed(json& j,json& jresult) {
-        jresult["success"] = true;
-        string square = j["square"];
-        int index = toIndex(square.c_str());
-        printf("square=%s index=%d\n",square.c_str(),index);
-        led(index,ledState[index]?LED_OFF:LED_ON); //flip from on to off and off to on
+    json newResult() {
+        json jresult;
+        jresult["success"]=false;
+        jresult["code"]=nullptr;
+        jresult["message"]=nullptr;
+        return jresult;
     }
 
-    void setPosition(const char* fen) {
-        clearLeds();
-        rules.Forsyth(fen);
-        for(int i=0; i<64; i++) {
-            squareState[i] = (rules.pieceAt(i) == ' ' ? 0 : 1);
-        }
-        gameMode = isBoardSetup() ? MODE_PLAY:MODE_SETPOSITION;
-    }
-    void setPosition(json& j,json& jresult) {
-        string fen = j["fen"];
-        setPosition(fen.c_str());
-        display_position(rules);
-        jresult["success"] = true;
+    /** Whether the action works on a board, the others can be used before the boards are set up. */
+    static bool boardAction(const string& action) {
+        return action == "move" || action == "setmode" || action == "led" || action == "setposition"
+                || action == "snapshot" || action == "findposition" || action == "explorer";
     }
 
-    void setMode(json& j,json& jresult) {
-        jresult["success"] = true;     //assume okay
-        if(j.count("mode")==1) {
-            string mode = j["mode"];
-            if(!mode.compare("play")) {
-                gameMode = MODE_PLAY;
-                jresult["message"] = "game mode set to MODE_PLAY";
-                clearLeds();
-            } else if(!mode.compare("setup")) {
-                gameMode = MODE_SETUP;
-                jresult["message"] = "game mode set to MODE_SETUP";
-                clearLeds();
-            } else if(!mode.compare("inspect")) {
-                gameMode = MODE_INSPECT;
-                jresult["message"] = "game mode set to MODE_INSPECT";
-                clearLeds();
+    /**
+     * Runs one command, filling in jresult.
+     * @return false if the command has no known action.
+     */
+    bool dispatch(Connection* conn,json& j,json& jresult) {
+        if(!j.is_object() || !j.contains("action") || !j["action"].is_string())
+            return false;
+        string action = j["action"];
+        LOG_DEBUG("parsed and have action = %s",action.c_str());
+        uint64_t start = monotonicMicros();
+        if(j.contains("id"))
+            jresult["id"] = j["id"];
+        Board* board = NULL;
+        if(boardAction(action)) {
+            board = boardFor(j);
+            if(!board) {
+                jresult["message"] = starting.empty() ? "no such board" : "the boards are starting";
+                return true;
+            }
+        }
+        try {
+            if (!action.compare("move")) {
+                completePending(board,PENDING_MOVE,false,"superseded");
+                board->doMove(j);
+                jresult["success"] = true;     //accepted, the player still has to make the move
+                addPending(conn,board,j,jresult,PENDING_MOVE);
+            } else if (!action.compare("cancel")) {
+                cancel(conn, j, jresult);
+            } else if (!action.compare("ping")) {
+                reply(conn,"pong");
+                jresult["success"] = true;
+            } else if (!action.compare("setmode")) {
+                board->setMode(j, jresult);
+            } else if (!action.compare("led")) {
+                board->setLed(j, jresult);
+            } else if (!action.compare("setposition")) {
+                completePending(board,PENDING_SETPOSITION,false,"superseded");
+                thc::ChessPosition before = board->rules;
+                board->setPosition(j, jresult);
+                if(journal)
+                    journal->position(board->id,before,board->rules);
+                if(board->gameMode == Board::MODE_SETPOSITION)
+                    addPending(conn,board,j,jresult,PENDING_SETPOSITION);
+            } else if (!action.compare("resume")) {
+                resume(conn, j, jresult);
+            } else if (!action.compare("snapshot")) {
+                snapshot(conn, board, j, jresult);
+            } else if (!action.compare("findposition")) {
+                findPosition(board, j, jresult);
+            } else if (!action.compare("getgame")) {
+                getGame(j, jresult);
+            } else if (!action.compare("explorer")) {
+                explorer(board, j, jresult);
+            } else if (!action.compare("hello")) {
+                hello(conn, j, jresult);
+            } else if (!action.compare("subscribe")) {
+                subscribe(conn, j, jresult);
+            } else if (!action.compare("shm")) {
+                sendShm(conn, jresult);
+            } else if (!action.compare("stats")) {
+                jresult["stats"] = stats();
+                jresult["success"] = true;
             } else {
-                jresult["message"] = "invalid mode";
-                jresult["success"] = false;
+                return false;
             }
-        } else {
-            jresult["message"] = "mode must be specified";
+        } catch(json::type_error& e) {
             jresult["success"] = false;
+            jresult["message"] = e.what();
         }
+        metrics.commandDone(action,jresult["success"],monotonicMicros()-start);
+        return true;
     }
 
-    void clearLeds() {
-        for(int i=0; i<64; i++) {
-            led(i,LED_OFF);
-        }
-    }
-
-    void turnOffLeds() {
-        for(int i=0; i<64; i++) {
-            digitalWrite(output[i], 0);
-        }
-    }
-
-    void doMove(TelnetServerSocket* psocket,const char* pszString) {
-        ChessAction *ca = parseJson(pszString);
-        int index=0;
-        waitMove.setFrom(ca->move(index).fromIndex());
-        waitMove.setTo(ca->move(index).toIndex());
-        waitMove.setType(ca->move(index).type());
-        ledState[ca->move(index).fromIndex()] = 1;
-        ledState[ca->move(index).toIndex()] = 1;
-        gameMode = MODE_MOVE;
-        moveIndex = 0;
-        if(!strcmp(ca->move(index).type(),"capture")) {
-            moveType[0] = MOVE_UP;
-            moveType[1] = MOVE_UP;
-            moveType[2] = MOVE_DOWN;
-            moveSquareIndex[0] = ca->move(index).fromIndex();
-            moveSquareIndex[1] = ca->move(index).toIndex();
-            moveSquareIndex[2] = ca->move(index).toIndex();
-            movesNeeded = 3;
-        } else if(!strcmp(ca->move(index).type(),"takeback_capture")) {
-            moveType[0] = MOVE_UP;
-            moveType[1] = MOVE_DOWN;
-            moveType[2] = MOVE_DOWN;
-            moveSquareIndex[0] = ca->move(index).fromIndex();
-            moveSquareIndex[1] = ca->move(index).fromIndex();
-            moveSquareIndex[2] = ca->move(index).toIndex();
-            led(ca->move(index).fromIndex(),LED_FLASH);
-            movesNeeded = 3;
-        } else {
-            moveType[0] = MOVE_UP;
-            moveType[1] = MOVE_DOWN;
-            moveSquareIndex[0] = ca->move(index).fromIndex();
-            moveSquareIndex[1] = ca->move(index).toIndex();
-            movesNeeded = 2;
+    /**
+     * Counters and latencies, times are in microseconds. Example:
+     * echo '{"action":"stats"}' | nc -C -N localhost 9999
+     */
+    json stats() {
+        json j;
+        j["uptime"] = metrics.uptime();
+        j["events"] = metrics.events;
+        j["eventsPerSec"] = metrics.eventsPerSec;
+        j["commands"] = metrics.commands;
+        j["commandErrors"] = metrics.commandErrors;
+        j["broadcast"] = metrics.broadcastTime.tojson();
+        json jcommands = json::object();
+        for(auto& it : metrics.commandTime)
+            jcommands[it.first] = it.second.tojson();
+        j["commandTime"] = jcommands;
+        json jboards = json::array();
+        for(auto board : boards) {
+            json jboard;
+            jboard["board"] = board->id;
+            jboard["scan"] = board->scanTime.tojson();
+            jboard["scanInterval"] = board->currentInterval;
+            jboard["rules"] = board->rulesTime.tojson();
+            jboard["busErrors"] = board->io->busErrors;
+            jboard["faultMask"] = toHex(board->io->faultMask);
+            jboards.push_back(jboard);
         }
-
-        for(int i=0; i<4; i++) {
-            printf("type[%d]=%c square index=%d\n",i,moveType[i],moveSquareIndex[i]);
+        j["boards"] = jboards;
+        if(journal) {
+            json jjournal;
+            jjournal["written"] = journal->written;
+            jjournal["syncs"] = journal->syncs;
+            jjournal["lastSync"] = journal->lastSyncMicros;
+            jjournal["dropped"] = journal->dropped;
+            jjournal["errors"] = journal->errors;
+            j["journal"] = jjournal;
         }
-
-        delete ca;
+        json jqueued = json::array();
+        for(auto conn : clients)
+            jqueued.push_back(conn->queued());
+        j["clientQueued"] = jqueued;
+        return j;
     }
 
-    void onConnection(PacketMessage* pmsg)
-    {
-        TelnetServerSocket* psocket = (TelnetServerSocket*)pmsg->socket();
-        psocket->println("Welcome to %s v%s", TITLE,VERSION);
+    /** The same as stats(), in the Prometheus text format. */
+    string prometheusText() {
+        string out;
+        char buffer[256];
+        snprintf(buffer,sizeof(buffer),
+                 "chesslr_uptime_seconds %g\nchesslr_events_total %llu\nchesslr_events_per_second %g\n"
+                 "chesslr_commands_total %llu\nchesslr_command_errors_total %llu\nchesslr_clients %u\n",
+                 metrics.uptime(),(unsigned long long)metrics.events,metrics.eventsPerSec,
+                 (unsigned long long)metrics.commands,(unsigned long long)metrics.commandErrors,(unsigned)clients.size());
+        out += buffer;
+        metrics.broadcastTime.prometheus(out,"chesslr_broadcast_seconds","");
+        for(auto& it : metrics.commandTime) {
+            snprintf(buffer,sizeof(buffer),"action=\"%s\"",it.first.c_str());
+            it.second.prometheus(out,"chesslr_command_seconds",buffer);
+        }
+        for(auto board : boards) {
+            snprintf(buffer,sizeof(buffer),"board=\"%d\"",board->id);
+            board->scanTime.prometheus(out,"chesslr_scan_seconds",buffer);
+            board->rulesTime.prometheus(out,"chesslr_rules_seconds",buffer);
+            snprintf(buffer,sizeof(buffer),"chesslr_bus_errors_total{board=\"%d\"} %llu\n",board->id,(unsigned long long)board->io->busErrors);
+            out += buffer;
+            snprintf(buffer,sizeof(buffer),"chesslr_faulty_squares{board=\"%d\"} %d\n",board->id,popCount(board->io->faultMask));
+            out += buffer;
+            snprintf(buffer,sizeof(buffer),"chesslr_scan_interval_seconds{board=\"%d\"} %g\n",board->id,board->currentInterval/1000.0);
+            out += buffer;
+        }
+        if(journal) {
+            snprintf(buffer,sizeof(buffer),
+                     "chesslr_journal_records_total %llu\nchesslr_journal_syncs_total %llu\nchesslr_journal_last_sync_seconds %g\n"
+                     "chesslr_journal_dropped_total %llu\nchesslr_journal_errors_total %llu\n",
+                     (unsigned long long)journal->written,(unsigned long long)journal->syncs,journal->lastSyncMicros/1e6,
+                     (unsigned long long)journal->dropped,(unsigned long long)journal->errors);
+            out += buffer;
+        }
+        for(size_t i=0; i<clients.size(); i++) {
+            snprintf(buffer,sizeof(buffer),"chesslr_client_queued_bytes{client=\"%u\"} %u\n",(unsigned)i,(unsigned)clients[i]->queued());
+            out += buffer;
+        }
+        return out;
     }
 
-    /** Returns a string like "a1". */
-    char* toMove(char* buffer, size_t n, char col, char row) {
-        snprintf(buffer, n, "%c%c", col, row);
-        return buffer;
-    }
-    char* toMove(char* buffer,size_t n,int index) {
-        snprintf(buffer,n,"%c%c",toCol(index),toRow(index));
-        return buffer;
+    /**
+     * If the command has an id, the client is sent a "complete" message with that id once the
+     * player has finished it on the board, and the reply says "pending":true. An optional
+     * "timeout" in milliseconds gives up waiting. Example:
+     * echo '{"action":"move","id":7,"timeout":30000,"moves":[{"from":"e2","to":"e4","type":"move"}]}' | nc -C -N localhost 9999
+     */
+    void addPending(Connection* conn,Board* board,json& j,json& jresult,int kind) {
+        if(!j.contains("id"))
+            return;
+        PendingOp op;
+        op.id = j["id"];
+        op.conn = conn;
+        op.board = board;
+        op.kind = kind;
+        op.deadline = 0;
+        if(j.count("timeout")==1 && j["timeout"].is_number_unsigned()) {
+            unsigned timeout = j["timeout"];
+            op.deadline = millis()+timeout;
+            if(!op.deadline)
+                op.deadline = 1;    //0 means no timeout
+        }
+        pending.push_back(op);
+        jresult["pending"] = true;
     }
 
-    /** Return the letter character of the column the index points to. The column should display before the row. */
-    char toCol(int index) {
-        int y = index/8;
-        int x = index-y*8;
-        return colNames[x];
+    /**
+     * Sends the completion for the pending command of that kind on the board, if there is one.
+     * @param code Why it failed, like "timeout", or NULL when it succeeded.
+     */
+    void completePending(Board* board,int kind,bool success,const char* code) {
+        for(size_t i=0; i<pending.size(); i++) {
+            if(pending[i].board == board && pending[i].kind == kind) {
+                sendComplete(pending[i],success,code);
+                pending.erase(pending.begin()+i);
+                return;
+            }
+        }
     }
 
-    /** Returns the number character of the row the index points to. You should use the column, then row. */
-    char toRow(int index) {
-        int y = index/8;
-        int x = index-y*8;
-        return rowNames[y];
+    void sendComplete(PendingOp& op,bool success,const char* code) {
+        json j;
+        j["action"] = "complete";
+        j["id"] = op.id;
+        j["success"] = success;
+        j["code"] = code ? json(code) : json(nullptr);
+        reply(op.conn,j.dump());
     }
 
-    /** Convert a string like "A1" into an index like 56, or "A8" to 0. Top left corner is 0, bottom right is 63. */
-    int toIndex(const char* square) {
-        int col=tolower(square[0])-'a';
-        int row=8-(square[1]-'0');
-//        printf("%s col=%d row=%d\n",square,col,row);
-        return row*8+col;
+    /**
+     * Stops waiting for a pending command the client sent, "target" is its id. A move is
+     * abandoned and the board goes back to what the game expects. A position still has to be
+     * set up, but nobody is told when it is. Example:
+     * echo '{"action":"cancel","target":7}' | nc -C -N localhost 9999
+     */
+    void cancel(Connection* conn,json& j,json& jresult) {
+        if(j.count("target")!=1 || !j["target"].is_primitive() || j["target"].is_null()) {
+            jresult["message"] = "target must be specified";
+            return;
+        }
+        for(size_t i=0; i<pending.size(); i++) {
+            if(pending[i].conn == conn && pending[i].id == j["target"]) {
+                abandonPending(i,"cancelled");
+                jresult["success"] = true;
+                return;
+            }
+        }
+        jresult["message"] = "nothing pending with that target id";
     }
 
-    int toIndex(char col,char row) {
-        char buffer[SAN_BUF_SIZE];
-        toMove(buffer,sizeof(buffer),col,row);
-        return toIndex(buffer);
+    void abandonPending(size_t i,const char* code) {
+        PendingOp op = pending[i];
+        pending.erase(pending.begin()+i);
+        Board* board = op.board;
+        if(op.kind == PENDING_MOVE && board->gameMode == Board::MODE_MOVE) {
+            board->moveIndex = 0;
+            board->resync();
+        }
+        sendComplete(op,false,code);
     }
 
-    //called every FREQ milliseconds
-    void idle(unsigned32 now) {
-        switch(gameMode) {
-            case MODE_INSPECT: idleShowPieces(); break;
-            case MODE_PLAY: idlePlay(); break;
-            case MODE_MOVE: idleMove(); break;
-            case MODE_SETPOSITION: idleSetPosition(); break;
-        }
-        flasher();
-    }
-
-    //Using ledState array, turns LEDs on, and flashes them if the flash bit is set
-    void flasher() {
-        flashState = !flashState;
-        for(int i=0; i<64; i++) {
-            int on=ledState[i]&1;
-            if(ledState[i]&2)
-                on=flashState;
-            digitalWrite(output[i],on?1:0);
-        }
-    }
-
-    void idleShowPieces() {
-        char buffer[1024];
-        for (int i = 0; i < 64; i++) {
-            int state = readState(i);
-            if (state != squareState[i]) {
-                snprintf(buffer, sizeof(buffer), "%c%c %s\r\n", toCol(i), toRow(i), (state ? "pieceDown" : "pieceUp"));
-                printf(buffer);
-                send2All(buffer);
+    /** Times out pending commands, and fails the ones something else got in the way of, like a setmode. */
+    void checkPending() {
+        unsigned now = millis();
+        for(size_t i=0; i<pending.size();) {
+            PendingOp& op = pending[i];
+            if(op.deadline && (int)(now-op.deadline) >= 0) {
+                abandonPending(i,"timeout");
+            } else if((op.kind == PENDING_MOVE && op.board->gameMode != Board::MODE_MOVE) ||
+                      (op.kind == PENDING_SETPOSITION && op.board->gameMode != Board::MODE_SETPOSITION)) {
+                sendComplete(op,false,"interrupted");
+                pending.erase(pending.begin()+i);
+            } else {
+                i++;
             }
-            squareState[i] = state;
-            led(i, state?LED_ON:LED_OFF);
         }
     }
 
     /**
-     * Turns on LEDs for any valid destination the piece at fromIndex can make.
-     *
-     * @param fromIndex Square that has the piece player is moving.
-     * @return true if there is at least one valid move, false otherwise.
+     * Sends the client every event it missed since the last sequence number it saw. If the ring
+     * no longer holds all of them, a snapshot of the current position is sent instead. Example:
+     * echo '{"action":"resume","seq":42}' | nc -C -N localhost 9999
      */
-    bool showValidSquares(int fromIndex) {
-        char bufFrom[SAN_BUF_SIZE],bufTo[SAN_BUF_SIZE];
-        snprintf(bufFrom, sizeof(bufFrom), "%c%c", toCol(fromIndex), toRow(fromIndex));
-//        printf("Move from %s\n",bufFrom);
-
-        std::vector<thc::Move> moves;
-        std::vector<bool> check;
-        std::vector<bool> mate;
-        std::vector<bool> stalemate;
-        rules.GenLegalMoveList(moves, check, mate, stalemate);
-        unsigned int len = moves.size();
-        int validMoves=0;
-        clearLeds();
-        led(fromIndex,LED_ON);
-        for(int i=0; i<len; i++) {
-            thc::Move mv = moves[i];
-            std::string mv_txt = mv.TerseOut();
-//            printf("checking move %s > %s\n",mv_txt.c_str(),bufFrom);
-            if(mv_txt[0] == bufFrom[0] && mv_txt[1] == bufFrom[1]) {
-                int to=toIndex(mv_txt[2],mv_txt[3]);
-                led(to,1);
-                validMoves++;
+    void resume(Connection* conn,json& j,json& jresult) {
+        if(j.count("seq")!=1 || !j["seq"].is_number_unsigned()) {
+            jresult["message"] = "seq must be specified";
+            return;
+        }
+        unsigned long seq = j["seq"];
+        jresult["success"] = true;
+        if(events.canReplay(seq)) {
+            for(unsigned long i=seq+1; i<=events.lastSeq(); i++) {
+                if(conn->wants(events.topic(i))) {
+                    const string& event = conn->binary ? events.frame(i) : events.at(i);
+                    conn->write(event.c_str(),event.size());
+                }
             }
+            jresult["message"] = "replayed";
+        } else {
+            for(auto board : boards)
+                reply(conn,snapshot(board).dump());
+            jresult["message"] = "snapshot";
         }
-//        printf("number of valid moves %d\n",len);
-        return validMoves>0;
     }
 
-    /** To long algebraic notation like "a2a3". */
-    char* toLAN(char* dest,size_t n,int from,int to) {
-        char bfrom[SAN_BUF_SIZE];
-        char bto[SAN_BUF_SIZE];
-        char bmove[SAN_BUF_SIZE];
-        toMove(bfrom,sizeof(bfrom),from);
-        toMove(bto,sizeof(bto),to);
-        snprintf(dest,n,"%s%s",bfrom,bto);
-        return dest;
+    /**
+     * The stored games that reached the board's position, oldest first, with how many half
+     * moves into the game it was. "limit" caps how many are listed (default 20), "count" is
+     * how many there are in all. Example:
+     * echo '{"action":"findposition","limit":5}' | nc -C -N localhost 9999
+     */
+    void findPosition(Board* board,json& j,json& jresult) {
+        if(!games) {
+            jresult["message"] = "no game database, start with --games";
+            return;
+        }
+        size_t limit = 20;
+        if(j.count("limit")==1 && j["limit"].is_number_unsigned())
+            limit = std::min(j["limit"].get<size_t>(),(size_t)1000);
+        vector<GameHit> hits;
+        size_t count = games->find(board->rules,limit,hits);
+        json jgames = json::array();
+        for(auto& hit : hits) {
+            json jgame;
+            jgame["game"] = hit.game;
+            jgame["ply"] = hit.ply;
+            jgame["moves"] = hit.moveCount;
+            jgame["result"] = GameDb::resultName(hit.result);
+            jgame["board"] = hit.board;
+            jgame["time"] = hit.time/1000000;
+            jgames.push_back(jgame);
+        }
+        jresult["count"] = count;
+        jresult["games"] = jgames;
+        jresult["success"] = true;
     }
 
-    void display_position(thc::ChessRules& cr)
-    {
-        std::string fen = cr.ForsythPublish();
-        std::string s = cr.ToDebugStr();
-        printf("FEN = %s\n", fen.c_str());
-        printf("Position = %s\n", s.c_str());
-    }
-
-    /** Flash the king of the current player. */
-    void flashKingCheck() {
-        int index=0;
-        for(int i=0; i<64; i++) {
-            if((rules.pieceAt(i) == 'k' && !rules.WhiteToPlay()) || (rules.pieceAt(i) == 'K' && rules.WhiteToPlay())) {
-                index = i;
+    /**
+     * A stored game: the position it started from, its moves and result. Example:
+     * echo '{"action":"getgame","game":12}' | nc -C -N localhost 9999
+     */
+    void getGame(json& j,json& jresult) {
+        if(!games) {
+            jresult["message"] = "no game database, start with --games";
+            return;
+        }
+        GameHeader header;
+        vector<uint16_t> moves;
+        if(j.count("game")!=1 || !j["game"].is_number_unsigned() || !games->load(j["game"].get<uint32_t>(),header,moves)) {
+            jresult["message"] = "no such game";
+            return;
+        }
+        thc::ChessRules rules;
+        thc::ChessPosition start;
+        start.Decompress(header.start.position);
+        start.half_move_clock = header.start.halfMoveClock;
+        start.full_move_count = header.start.fullMoveCount;
+        rules = start;
+        jresult["fen"] = rules.ForsythPublish();
+        json jmoves = json::array();
+        for(auto packed : moves) {
+            thc::Move mv;
+            if(!unpackMove(rules,packed,mv))
                 break;
-            }
+            jmoves.push_back(mv.TerseOut());
+            rules.PlayMove(mv);
         }
+        jresult["moves"] = jmoves;
+        jresult["result"] = GameDb::resultName(header.result);
+        jresult["board"] = header.board;
+        jresult["time"] = header.time/1000000;
+        jresult["success"] = true;
+    }
 
-        long delay=100000;
-        turnOffLeds();  //force the leds off, instead of waiting for next idle call
-        usleep(delay);
-        digitalWrite(output[index],1);
-        usleep(delay);
-        digitalWrite(output[index],0);
-        usleep(delay);
-        digitalWrite(output[index],1);
-        usleep(delay);
-        digitalWrite(output[index],0);
-    }
-
-    /** Look to see if we are in checkmate, and set checkmated king's square to flash. */
-    void evaluateCheckMate() {
-        thc::TERMINAL terminal;
-        rules.Evaluate(terminal);
-        switch(terminal) {
-            case thc::TERMINAL::TERMINAL_BCHECKMATE: printf("black checkmate\n"); break;
-            case thc::TERMINAL::TERMINAL_WCHECKMATE: printf("white checkmate\n"); break;
-        }
-        if(terminal==thc::TERMINAL::TERMINAL_BCHECKMATE || terminal==thc::TERMINAL::TERMINAL_WCHECKMATE) {
-            gameMode=MODE_MATE;
-            for(int i=0; i<64; i++) {
-                if(rules.pieceAt(i) == 'k' && terminal == thc::TERMINAL::TERMINAL_BCHECKMATE)
-                    led(i,LED_FLASH);
-                else if(rules.pieceAt(i) == 'K' && terminal == thc::TERMINAL::TERMINAL_WCHECKMATE)
-                    led(i,LED_FLASH);
-            }
+    /**
+     * The moves played from the board's position in the games chesslrindex was given, most
+     * played first, with how those games ended. "limit" caps how many are listed (default 10).
+     * "leds":true lights the most played move on the board, its from square solid and its to
+     * square flashing. Example:
+     * echo '{"action":"explorer","limit":3,"leds":true}' | nc -C -N localhost 9999
+     */
+    void explorer(Board* board,json& j,json& jresult) {
+        if(!explorerTable) {
+            jresult["message"] = "no explorer table, start with --explorer";
+            return;
+        }
+        size_t limit = 10;
+        if(j.count("limit")==1 && j["limit"].is_number_unsigned())
+            limit = j["limit"].get<size_t>();
+        vector<ExplorerEntry> entries;
+        explorerTable->lookup(board->rules,entries);
+        json jmoves = json::array();
+        uint64_t total=0;
+        thc::Move top;
+        top.Invalid();
+        for(auto& entry : entries) {
+            total += entry.count;
+            thc::Move mv;
+            if(jmoves.size() >= limit || !unpackMove(board->rules,entry.move,mv))
+                continue;
+            if(!top.Valid())
+                top = mv;
+            json jmove;
+            jmove["move"] = mv.TerseOut();
+            jmove["san"] = mv.NaturalOut(&board->rules);
+            jmove["count"] = entry.count;
+            jmove["white"] = entry.white;
+            jmove["draws"] = entry.draws;
+            jmove["black"] = entry.black;
+            jmoves.push_back(jmove);
+        }
+        if(j.count("leds")==1 && j["leds"].is_boolean() && j["leds"] && top.Valid()) {
+            board->led(top.src,LED_ON);
+            board->led(top.dst,LED_FLASH);
         }
+        jresult["games"] = total;
+        jresult["moves"] = jmoves;
+        jresult["success"] = true;
     }
 
-    /** Check if there is a draw. */
-    void evaluateDraw() {
-        //todo lee implement evaluate draw
-
-        //        thc::DRAWTYPE drawType;
-//        rules.IsDraw(rules.WhiteToPlay(),drawType);
-//        switch(drawType) {
-//            case thc::DRAWTYPE::DRAWTYPE_50MOVE: printf("DRAWTYPE_50MOVE\n"); break;
-//            case thc::DRAWTYPE::DRAWTYPE_INSUFFICIENT: printf("DRAWTYPE_INSUFFICIENT\n"); break;
-//            case thc::DRAWTYPE::DRAWTYPE_INSUFFICIENT_AUTO: printf("DRAWTYPE_INSUFFICIENT_AUTO\n"); break;
-//            case thc::DRAWTYPE::DRAWTYPE_REPITITION: printf("DRAWTYPE_DRAWTYPE_REPITITION"); break;
-//        }
-//        if(drawType != thc::DRAWTYPE::NOT_DRAW) {
-//            for(int i=0; i<64; i++) {
-//                if(rules.pieceAt(i) == 'k' || rules.pieceAt(i) == 'K')
-//                    led(i,LED_FLASH);
-//            }
-//        }
-    }
-
-    /** Piece was put down, now check what the move was. */
-    void finishMove(int toIndex) {
-        moveIndex = 0;
-        clearLeds();
-        if(toIndex != moveSquareIndex[0]) {
-            //this is a move, player didn't replace the piece on the square they lifted it off from
-            char buffer[SAN_BUF_SIZE];
-            toLAN(buffer, sizeof(buffer), moveSquareIndex[0], toIndex);
-            thc::Move mv;
-            mv.TerseIn(&rules, buffer);
-//            printf("full move is %s - %s\n", buffer,mv.NaturalOut(&rules).c_str());
-            if(!mv.Valid()) {
-                json j;
-                j["action"] = "invalid_move";
-                j["long"] = mv.TerseOut();
-                j["san"] = mv.NaturalOut(&rules);
-                printf("%s\n",j.dump().c_str());
-                send2All(j.dump().c_str());
-                send2All("\r\n");
-                setPosition(rules.ForsythPublish().c_str());
-                return;
-            }
-            string san = mv.NaturalOut(&rules).c_str();
-            bool kingChecked = rules.isCheck(mv);
-            bool capture = mv.NaturalOut(&rules).find('x')!=string::npos;
-
-            vector<json> moveList;
-            json move;
-            move["type"]=capture ? "capture":"move";
-            move["from"]=toMove(buffer,sizeof(buffer),moveSquareIndex[0]);
-            move["to"]=toMove(buffer,sizeof(buffer),toIndex);
-            move["long"] = mv.TerseOut().c_str();
-            move["san"] = san;
-            moveList.push_back(move);
-
-            json j;
-            j["action"] = "move";
-            j["description"] = nullptr;
-            j["moves"]=moveList;
-            printf("%s\n",j.dump().c_str());
-
-            send2All(j.dump().c_str());
-            send2All("\r\n");
-            rules.PlayMove(mv);
-            display_position(rules);
-            printf("san=%s check=%d kingChecked=%d\n",san.c_str(),san.find_first_of('+'),kingChecked);
-            if(kingChecked) {
-                flashKingCheck();
+    /**
+     * Compact description of a board's current state: the occupancy the sensors see, the LEDs
+     * that are on and flashing as bitboards, the position and mode. Also used when a client is
+     * too far behind to replay events, then it gets one for each board.
+     */
+    json snapshot(Board* board) {
+        json j;
+        j["action"] = "snapshot";
+        j["board"] = board->id;
+        j["seq"] = events.lastSeq();
+        j["occupancy"] = toHex(board->sensed);
+        j["leds"] = toHex(board->ledOn);
+        j["flash"] = toHex(board->ledFlash);
+        j["fen"] = board->rules.ForsythPublish();
+        j["mode"] = board->modeName(board->gameMode);
+        return j;
+    }
+
+    /**
+     * Sends the client a snapshot of the board. With "stream" set, the client is then sent a diff every
+     * "interval" milliseconds (default 100) holding only the bits that changed since the last
+     * snapshot or diff, and nothing if nothing changed. "stream":false stops the diffs. Example:
+     * echo '{"action":"snapshot","stream":true,"interval":50}' | nc -C -N localhost 9999
+     */
+    void snapshot(Connection* conn,Board* board,json& j,json& jresult) {
+        if(j.count("stream")==1 && j["stream"].is_boolean()) {
+            if(j["stream"]) {
+                unsigned interval = 100;
+                if(j.count("interval")==1 && j["interval"].is_number_unsigned())
+                    interval = j["interval"];
+                conn->diffInterval = interval < FREQ ? FREQ : interval;
+            } else {
+                conn->diffInterval = 0;
             }
         }
-        setPosition(rules.ForsythPublish().c_str());
-        evaluateCheckMate();
-        evaluateDraw();
-    }
-
-    void idlePlay() {
-        //check each square to see if its state has changed
-        for (int i = 0; i < 64; i++) {
-            int state = readState(i);
-            if (state != squareState[i]) {
-                //state 0=piece lifted, 1=piece dropped
-                squareState[i] = state;
-                char buffer[SAN_BUF_SIZE];
-                toMove(buffer, sizeof(buffer), toCol(i), toRow(i));
-                json j;
-                j["action"] = state ? "pieceDown" : "pieceUp";
-                j["square"] = buffer;
-                printf("%s state=%d moveIndex=%d\n",j.dump().c_str(),state,moveIndex);
-                send2All(j.dump().c_str());
-                send2All("\r\n");
-
-                if (!state && !moveIndex) {
-                    //picked up first piece
-                    printf("picked up first piece\n");
-                    if(showValidSquares(i)) {
-                        moveType[moveIndex] = MOVE_UP;
-                        moveSquareIndex[moveIndex] = i;
-                        moveIndex++;
-                    } else {
-                        //todo lee would like to be able to pick up the piece you are capturing first
-                        printf("You can't move that piece\n");
-                        while(!readState(i)) {
-                            usleep(100000);
-                            digitalWrite(output[i],1);
-                            usleep(100000);
-                            digitalWrite(output[i],0);
-                            usleep(100000);
-                            digitalWrite(output[i],1);
-                            usleep(100000);
-                            digitalWrite(output[i],0);
-                            usleep(300000);
-                        }
-                        led(i,LED_OFF);
-                        squareState[i] = readState(i);
-                        j["action"] = squareState[i] ? "pieceDown" : "pieceUp";
-                        j["square"] = buffer;
-                        printf("%s state=%d moveIndex=%d\n",j.dump().c_str(),state,moveIndex);
-                        send2All(j.dump().c_str());
-                        send2All("\r\n");
-                    }
-                } else if(!state && moveIndex<2) {
-                    //picked up another piece
-                    printf("picked up a second piece\n");
-                    moveType[moveIndex] = MOVE_UP;
-                    moveSquareIndex[moveIndex] = i;
-                    moveIndex++;
-                    led(i, LED_ON);
-                } else if(!state && moveIndex>=2) {
-                    //picked up more then 2 pieces
-                    printf("picked up too many pieces\n");
-                    setPosition(rules.ForsythPublish().c_str());
-                } else if(state && !moveIndex) {
-                    //piece down but no piece up, not valid
-                    printf("put down a piece but none picked up\n");
-                    setPosition(rules.ForsythPublish().c_str());
-                } else if(state) {
-                    //piece down
-                    printf("put down piece\n");
-                    moveType[moveIndex] = MOVE_DOWN;
-                    moveSquareIndex[moveIndex] = i;
-                    moveIndex++;
-                    finishMove(i);
-                } else {
-                    printf("WARNING should not get here\n");
-                    assert(false);
-                }
-                break;  //only process one square change at a time
+        conn->diffBoard = board->id;
+        conn->diffOccupancy = board->sensed;
+        conn->diffLeds = board->ledOn;
+        conn->diffFlash = board->ledFlash;
+        reply(conn,snapshot(board).dump());
+        jresult["success"] = true;
+    }
+
+    /** Sends a diff to each streaming client that is due one and has something that changed on its board. */
+    void sendDiffs(unsigned32 now) {
+        for(auto conn : clients) {
+            if(!conn->diffInterval || now-conn->diffLast < conn->diffInterval)
+                continue;
+            conn->diffLast = now;
+            Board* board = boards[conn->diffBoard];
+            uint64_t occ = board->sensed;
+            uint64_t leds = board->ledOn;
+            uint64_t flash = board->ledFlash;
+            uint64_t dOcc = occ^conn->diffOccupancy;
+            uint64_t dLeds = leds^conn->diffLeds;
+            uint64_t dFlash = flash^conn->diffFlash;
+            if(!dOcc && !dLeds && !dFlash)
+                continue;
+            conn->diffOccupancy = occ;
+            conn->diffLeds = leds;
+            conn->diffFlash = flash;
+            if(conn->binary) {
+                const string& frame = frames.diff(board->id,dOcc,dLeds,dFlash);
+                conn->write(frame.c_str(),frame.size());
+            } else {
+                json jdiff;
+                jdiff["action"] = "diff";
+                jdiff["board"] = board->id;
+                if(dOcc) jdiff["occupancy"] = toHex(dOcc);
+                if(dLeds) jdiff["leds"] = toHex(dLeds);
+                if(dFlash) jdiff["flash"] = toHex(dFlash);
+                string line = jdiff.dump()+"\r\n";
+                conn->write(line.c_str(),line.size());
             }
         }
     }
 
-    void idleMove() {
-        for (int i = 0; i < 64 && gameMode==MODE_MOVE; i++) {
-            int state = readState(i);
-            if (state != squareState[i]) {
-                char type = state ? MOVE_DOWN:MOVE_UP;
-                if(moveType[moveIndex] == type && moveSquareIndex[moveIndex] == i) {
-                    printf("got move %d %c\n",moveIndex,moveType[moveIndex]);
-                    bool resetLed = (moveIndex==1 && type==MOVE_UP) ? false:true;
-                    if(resetLed)
-                        led(i,LED_OFF);
-                    moveIndex++;
-                    if(moveIndex == movesNeeded) {
-                        gameMode = MODE_PLAY;
-                        printf("Move finished json=\n",waitMove.tojson().dump().c_str());
-                        send2All(waitMove.tojson().dump().c_str());
-                        send2All("\r\n");
-                        finishMove(moveSquareIndex[moveIndex-1]);
-                    }
-                } else {
-                    char buffer[SAN_BUF_SIZE];
-                    snprintf(buffer, sizeof(buffer), "%c%c", toCol(i), toRow(i));
-                    json j;
-                    j["action"] = state ? "pieceDown" : "pieceUp";
-                    j["square"] = buffer;
-                    printf("%s\n",j.dump().c_str());
-                    send2All(j.dump().c_str());
-                    send2All("\r\n");
-                }
-            }
-            squareState[i] = state;
+    /** Bitboard as 16 hex digits, since json numbers can't hold 64 bits for every client. */
+    string toHex(uint64_t bits) {
+        char buffer[17];
+        snprintf(buffer,sizeof(buffer),"%016llx",(unsigned long long)bits);
+        return buffer;
+    }
+
+    /**
+     * Sends a line of text to the client, in whatever framing the client asked for. The text
+     * doesn't include the line terminator.
+     */
+    void reply(Connection* conn,const string& text) {
+        if(conn->binary) {
+            const string& frame = frames.text(text.c_str(),text.size());
+            conn->write(frame.c_str(),frame.size());
+        } else {
+            string line = text+"\r\n";
+            conn->write(line.c_str(),line.size());
         }
     }
 
-    /** Any squares that need a piece, will be solid. Any square that has a piece that should not
-     * will flash.
+    /**
+     * Picks the protocol for the connection, "json" (the default) or "binary". The reply to the
+     * line holding the hello is sent using the old protocol, everything after it uses the new one.
+     * Example:
+     * echo '{"action":"hello","protocol":"binary"}' | nc -C -N localhost 9999
      */
-    void idleSetPosition() {
-        //setup what it should look like
-        bool complete=true;
-        for (int i = 0; i < 64; i++) {
-            int state = readState(i);
-            if(squareState[i] != state) {
-                complete=false;
-                if(state && !squareState[i])
-                    led(i,LED_FLASH);   //flash
-                else if(!state && squareState[i])
-                    led(i,LED_ON);   //just turn it on
+    void hello(Connection* conn,json& j,json& jresult) {
+        bool binary = conn->binaryNext;
+        if(j.count("protocol")==1 && j["protocol"].is_string()) {
+            string protocol = j["protocol"];
+            if(!protocol.compare("binary")) {
+                binary = true;
+                jresult["success"] = true;
+            } else if(!protocol.compare("json")) {
+                binary = false;
+                jresult["success"] = true;
             } else {
-                led(i,LED_OFF);
+                jresult["message"] = "invalid protocol";
             }
+        } else {
+            jresult["message"] = "protocol must be specified";
         }
-        if(complete) {
-            clearLeds();
-            gameMode = MODE_PLAY;
-            json j;
-            j["action"] = "setposition";
-            j["status"] = "complete";
-            printf("%s\n",j.dump().c_str());
-            send2All(j.dump().c_str());
-            send2All("\r\n");
-        }
+        jresult["protocol"] = binary ? "binary" : "json";
+        conn->binaryNext = binary;
     }
 
-    /** Checks if all squares have a piece that should, and the ones that should not are empty. */
-    bool isBoardSetup() {
-        bool setup=true;
-        for (int i = 0; i < 64; i++) {
-            int state = readState(i);
-            if(state != squareState[i])
-                setup=false;
+    /**
+     * Only send the client the events it asks for. Topics are the action names of the events,
+     * or "all". Example:
+     * echo '{"action":"subscribe","topics":["move","invalid_move"]}' | nc -C -N localhost 9999
+     */
+    void subscribe(Connection* conn,json& j,json& jresult) {
+        if(j.count("topics")!=1 || !j["topics"].is_array()) {
+            jresult["message"] = "topics must be specified";
+            return;
         }
-        return setup;
+        unsigned topics=0;
+        for(auto& name : j["topics"]) {
+            unsigned topic = name.is_string() ? topicFromName(name) : 0;
+            if(!topic) {
+                jresult["message"] = "invalid topic";
+                return;
+            }
+            topics |= topic;
+        }
+        conn->topics = topics;
+        jresult["success"] = true;
     }
 
     /**
-     * Checks if a piece is detected on the given square.
-     * @param index Square to check.
-     * @return 0 if empty, 1 if a piece is detected.
+     * Keeps the event for resume and sends it to the clients subscribed to the topic. The line
+     * comes from the encoder and the frame from the frame encoder, both already stamped with
+     * events.nextSeq() and complete, so every client gets the same bytes in a single write.
      */
-    int readState(int index) {
-        return digitalRead(input[index])==0 ? 1:0;
+    void broadcast(unsigned topic,const string& line,const string& frame) {
+        LOG_INFO("%.*s",(int)line.size()-2,line.c_str());
+        uint64_t start = monotonicMicros();
+        metrics.events++;
+        events.add(topic,line,frame);
+        if(shm.created())
+            shm.publish(events.lastSeq(),frame);
+        for(auto conn : clients) {
+            if(conn->wants(topic))
+                conn->sendEvent(events.lastSeq(),line,frame);
+        }
+        metrics.broadcastTime.add(monotonicMicros()-start);
+    }
+
+    void onPiece(Board* board,int index,int state) {
+        char buffer[SAN_BUF_SIZE];
+        board->toMove(buffer,sizeof(buffer),index);
+        unsigned long seq = events.nextSeq();
+        broadcast(state ? TOPIC_PIECE_DOWN : TOPIC_PIECE_UP,
+                  encoder.piece(state,buffer,board->id,seq),
+                  frames.piece(state,index,board->occupancy(),board->id,seq,board->sensedAt));
+    }
+
+    /** Inspect mode is for checking the wiring, so everyone gets plain text. */
+    void onInspect(Board* board,int index,int state) {
+        char buffer[80];
+        snprintf(buffer,sizeof(buffer),"%d %c%c %s\r\n",board->id,board->toCol(index),board->toRow(index),(state ? "pieceDown" : "pieceUp"));
+        send2All(buffer);
+    }
+
+    void onMove(Board* board,int from,int to,thc::Move mv,const char* san,bool capture,bool check) {
+        char fromSquare[SAN_BUF_SIZE],toSquare[SAN_BUF_SIZE];
+        board->toMove(fromSquare,sizeof(fromSquare),from);
+        board->toMove(toSquare,sizeof(toSquare),to);
+        if(journal)
+            journal->move(board->id,board->rules,mv);
+        unsigned long seq = events.nextSeq();
+        broadcast(TOPIC_MOVE,
+                  encoder.move(capture ? "capture":"move",fromSquare,toSquare,mv.TerseOut().c_str(),san,board->id,seq),
+                  frames.move(packMove(mv),(capture?MOVE_FLAG_CAPTURE:0)|(check?MOVE_FLAG_CHECK:0),board->id,seq,board->sensedAt));
+    }
+
+    void onInvalidMove(Board* board,int from,int to,const char* lan,const char* san) {
+        unsigned long seq = events.nextSeq();
+        broadcast(TOPIC_INVALID_MOVE,
+                  encoder.invalidMove(lan,san,board->id,seq),
+                  frames.invalidMove(packMove(from,to,thc::NOT_SPECIAL),board->id,seq,board->sensedAt));
+    }
+
+    void onMoveFinished(Board* board) {
+        ChessMove& waitMove = board->waitMove;
+        if(journal && !strncmp(waitMove.type(),"takeback",8))
+            journal->takeback(board->id,board->rules,waitMove.fromIndex(),waitMove.toIndex());
+        unsigned long seq = events.nextSeq();
+        broadcast(TOPIC_MOVE,
+                  encoder.moveFinished(waitMove.m_from.c_str(),waitMove.m_to.c_str(),waitMove.type(),waitMove.m_description.c_str(),board->id,seq),
+                  frames.move(packMove(waitMove.fromIndex(),waitMove.toIndex(),thc::NOT_SPECIAL),
+                              !strcmp(waitMove.type(),"capture") ? MOVE_FLAG_CAPTURE:0,board->id,seq,board->sensedAt));
+        completePending(board,PENDING_MOVE,true,NULL);
+    }
+
+    void onSetPositionComplete(Board* board) {
+        unsigned long seq = events.nextSeq();
+        broadcast(TOPIC_SETPOSITION,encoder.setPositionComplete(board->id,seq),frames.setPositionComplete(board->id,seq,board->sensedAt));
+        completePending(board,PENDING_SETPOSITION,true,NULL);
+    }
+
+    void onGameOver(Board* board) {
+        if(games)
+            games->store(board);
+    }
+
+    void onConnection(PacketMessage* pmsg)
+    {
+        TelnetServerSocket* psocket = (TelnetServerSocket*)pmsg->socket();
+        Connection* conn = new TelnetConnection(psocket);
+        telnetClients[psocket] = conn;
+        onConnect(conn);
+    }
+
+    void onClosed(PacketMessage* pmsg)
+    {
+        TelnetServerSocket* psocket = (TelnetServerSocket*)pmsg->socket();
+        auto it = telnetClients.find(psocket);
+        if(it != telnetClients.end()) {
+            onDisconnect(it->second);
+            delete it->second;
+            telnetClients.erase(it);
+        }
     }
 
-    // Return true if the square is occupied, false otherwise.
-    bool isSquareOccupied(int index) {
-        return squareState[index]==1;   //0=occupied, 1=not
+    void onConnect(Connection* conn) {
+        clients.push_back(conn);
+        char buffer[80];
+        int n = snprintf(buffer,sizeof(buffer),"Welcome to %s v%s\r\n",TITLE,VERSION);
+        conn->write(buffer,n);
     }
 
-    // Return true if the state given means the square is occupied, false otherwise
-    bool isStateOccupied(int state) {
-        return state==0;
+    void onDisconnect(Connection* conn) {
+        for(size_t i=0; i<clients.size(); i++) {
+            if(clients[i] == conn) {
+                clients.erase(clients.begin()+i);
+                break;
+            }
+        }
+        for(size_t i=0; i<pending.size();) {
+            if(pending[i].conn == conn)
+                pending.erase(pending.begin()+i);
+            else
+                i++;
+        }
+        LOG_INFO("connection closed");
     }
 
-    /** Sets the LED state, doesn't actually turn on/off the led. */
-    void led(int index,int state) {
-        ledState[index] = state;
+    /** Also accept clients on a unix domain socket at path. */
+    bool listenLocal(const char* path) {
+        if(!local.listen(path))
+            return false;
+        printf("Listening on %s\n",path);
+        return true;
+    }
+
+    /** Also accept browsers on a WebSocket port. */
+    bool listenWebSocket(int port) {
+        if(!ws.listen(port))
+            return false;
+        printf("WebSocket listening on port %d\n",port);
+        return true;
+    }
+
+    /** Serve Prometheus metrics over HTTP on a port of their own. */
+    bool listenMetrics(int port) {
+        if(!metricsPort.listen(port))
+            return false;
+        printf("Metrics on port %d\n",port);
+        return true;
+    }
+
+    /** Publish events and the board state to a shared memory region, that local clients get with the shm action. */
+    bool enableShm() {
+        if(!shm.create())
+            return false;
+        for(auto board : boards)
+            shm.setState(board->id,board->occupancy(),board->ledOn,board->ledFlash);
+        return true;
+    }
+
+    /**
+     * Passes the shared memory region to a client on the unix socket. The fd comes with a line
+     * {"action":"shm","size":N}, the region is laid out as described in shmring.hpp. Example,
+     * from a program connected to the unix socket: {"action":"shm"}
+     */
+    void sendShm(Connection* conn,json& jresult) {
+        if(!shm.created()) {
+            jresult["message"] = "shared memory is not enabled";
+            return;
+        }
+        if(!local.owns(conn)) {
+            jresult["message"] = "shared memory is only available on the unix socket";
+            return;
+        }
+        json j;
+        j["action"] = "shm";
+        j["size"] = shm.size();
+        if(!local.sendFd((SocketConnection*)conn,shm.fd(),j.dump())) {
+            jresult["message"] = "unable to send the shared memory fd";
+            return;
+        }
+        jresult["success"] = true;
     }
+
+    /**
+     * Reports how long startup took, and starts a game on the boards once they're set up, or
+     * carries on with the saved one.
+     */
+    void idleStartup() {
+        if(!loopStarted) {
+            loopStarted = true;
+            LOG_INFO("event loop running %.1f ms after start",(monotonicMicros()-launchedAt)/1000.0);
+        }
+        if(starting.empty())
+            return;
+        size_t first = boards.size();
+        if(!hardwareStarted())
+            return;
+        for(size_t i=first; i<boards.size(); i++) {
+            if(state && state->load(boards[i]))
+                boards[i]->resume();
+            else
+                boards[i]->initGame();
+        }
+        LOG_INFO("boards ready %.1f ms after start",(monotonicMicros()-launchedAt)/1000.0);
+    }
+
+    //called every FREQ milliseconds
+    void idle(unsigned32 now) {
+        if(!loopStarted || !starting.empty())
+            idleStartup();
+        for(auto board : boards)
+            board->idle(now);
+        if(state) {
+            for(auto board : boards)
+                state->save(board);
+        }
+        if(games)
+            games->poll();
+        if(!pending.empty())
+            checkPending();
+        sendDiffs(now);
+        if(shm.created()) {
+            for(auto board : boards)
+                shm.setState(board->id,board->occupancy(),board->ledOn,board->ledFlash);
+        }
+        metrics.tick();
+        if(capture && now-captureFlushed >= 1000) {
+            capture->flush();
+            captureFlushed = now;
+        }
+        local.poll();
+        ws.poll();
+        metricsPort.poll();
+    }
+
 };
 
 int main(int argc,char* argv[]) {
+    uint64_t launched = monotonicMicros();
     bool swap=false;
     bool turnOffLeds=false;
+    bool useShm=false;
+    const char* unixPath=NULL;
+    vector<string> boardSpecs;
+    int wsPort=0;
+    int metricsPort=0;
+    const char* recordPath=NULL;
+    const char* replayPath=NULL;
+    double replaySpeed=1;
+    const char* simPath=NULL;
+    const char* i2cPath=NULL;
+    const char* statePath=NULL;
+    const char* journalPath=NULL;
+    const char* gamesPath=NULL;
+    const char* explorerPath=NULL;
+    int simBoards=1;
+    unsigned maxScanInterval=80;
+    SimParams simParams;
     unsigned16 wPort = 9999;
     for(int i=0; i<argc; i++) {
         if(!strcmp(argv[i],"-s")) {
@@ -780,17 +1083,151 @@ int main(int argc,char* argv[]) {
             wPort = atoi(argv[++i]);
         } else if(!strcmp(argv[i],"--leds-off")) {
             turnOffLeds=true;
+        } else if(!strcmp(argv[i],"--unix")) {
+            unixPath = argv[++i];
+        } else if(!strcmp(argv[i],"--ws-port")) {
+            wsPort = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--shm")) {
+            useShm=true;
+        } else if(!strcmp(argv[i],"--log-level")) {
+            int level = Logger::levelFromName(argv[++i]);
+            if(level < 0) {
+                printf("Invalid log level %s, expected error, warn, info or debug\n",argv[i]);
+                return 1;
+            }
+            Logger::instance().setLevel(level);
+        } else if(!strcmp(argv[i],"--metrics-port")) {
+            metricsPort = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--board")) {
+            boardSpecs.push_back(argv[++i]);
+        } else if(!strcmp(argv[i],"--max-scan-interval")) {
+            maxScanInterval = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--i2c-dev")) {
+            i2cPath = argv[++i];
+        } else if(!strcmp(argv[i],"--state")) {
+            statePath = argv[++i];
+        } else if(!strcmp(argv[i],"--journal")) {
+            journalPath = argv[++i];
+        } else if(!strcmp(argv[i],"--games")) {
+            gamesPath = argv[++i];
+        } else if(!strcmp(argv[i],"--explorer")) {
+            explorerPath = argv[++i];
+        } else if(!strcmp(argv[i],"--record")) {
+            recordPath = argv[++i];
+        } else if(!strcmp(argv[i],"--replay")) {
+            replayPath = argv[++i];
+        } else if(!strcmp(argv[i],"--replay-speed")) {
+            replaySpeed = atof(argv[++i]);
+        } else if(!strcmp(argv[i],"--simulate")) {
+            simPath = argv[++i];
+        } else if(!strcmp(argv[i],"--sim-boards")) {
+            simBoards = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--sim-speed")) {
+            simParams.speed = atof(argv[++i]);
+        } else if(!strcmp(argv[i],"--sim-jitter")) {
+            simParams.jitter = atoi(argv[++i])*1000;
+        } else if(!strcmp(argv[i],"--sim-bounce")) {
+            simParams.bounce = atoi(argv[++i])*1000;
         }
     }
     printf("Binding to port %d\n",wPort);
     SockAddr saBind((ULONG)INADDR_ANY,wPort);
     printf("%s runs on port %d\n",TITLE,wPort);
-    ControllerServer server(saBind,swap);
+    ControllerServer server(saBind,launched);
+    CaptureWriter capture;
+    if(recordPath) {
+        if(!capture.open(recordPath))
+            return 1;
+        server.capture = &capture;
+    }
+    Replay replay;
+    vector<SimGame> simGames;
+    if(replayPath) {
+        //the boards come from the capture, the hardware isn't touched
+        if(!replay.load(replayPath))
+            return 1;
+        replay.speed = replaySpeed;
+        for(size_t i=0; i<replay.boards.size(); i++)
+            server.addBoard(new ReplayIO(&replay,i));
+        boardSpecs.clear();
+    } else if(simPath) {
+        //virtual boards playing the games, the hardware isn't touched
+        if(!loadSimGames(simPath,simGames) || simBoards < 1 || simParams.speed <= 0) {
+            printf("Nothing to simulate\n");
+            return 1;
+        }
+        printf("Simulating %d boards playing %u games\n",simBoards,(unsigned)simGames.size());
+        for(int i=0; i<simBoards; i++)
+            server.addBoard(new SimulatedIO(&simGames[i%simGames.size()],&simParams,i+1));
+        boardSpecs.clear();
+    } else if(i2cPath) {
+        //the chips are driven through the kernel, wiringPi isn't used
+        if(boardSpecs.empty())
+            server.addBoard(new I2cDevIO(i2cPath,0,0,swap));
+    } else {
+        wiringPiSetup();
+        if(boardSpecs.empty())
+            server.addBoard(new WiringPiIO(0,0,0,swap));
+    }
+    for(size_t i=0; i<boardSpecs.size(); i++) {
+        //<mux>:<channel>[:<scan interval>], like 0x70:3 or 0x70:3:20
+        int mux=0,channel=0;
+        unsigned interval=0;
+        if(sscanf(boardSpecs[i].c_str(),"%i:%i:%u",&mux,&channel,&interval) < 2 || channel < 0 || channel > 7) {
+            printf("Invalid board %s, expected <mux>:<channel>[:<scan interval>]\n",boardSpecs[i].c_str());
+            return 1;
+        }
+        BoardIO* io;
+        if(i2cPath)
+            io = new I2cDevIO(i2cPath,mux,channel,swap && i==0);
+        else
+            io = new WiringPiIO(i,mux,channel,swap && i==0);
+        Board* board = server.addBoard(io);
+        board->scanInterval = interval;
+    }
+    for(auto board : server.starting)
+        board->maxScanInterval = maxScanInterval;
+    StateFile stateFile;
+    if(statePath) {
+        if(!stateFile.open(statePath,server.starting.size()))
+            return 1;
+        server.state = &stateFile;
+    }
+    Journal journal;
+    if(journalPath) {
+        if(!journal.open(journalPath))
+            return 1;
+        server.journal = &journal;
+    }
+    GameDb games;
+    if(gamesPath) {
+        if(!games.open(gamesPath))
+            return 1;
+        server.games = &games;
+    }
+    ExplorerTable explorerTable;
+    if(explorerPath) {
+        if(!explorerTable.open(explorerPath))
+            return 1;
+        LOG_INFO("%s has %llu moves from %llu games",explorerPath,(unsigned long long)explorerTable.entries(),(unsigned long long)explorerTable.games());
+        server.explorerTable = &explorerTable;
+    }
+    server.startHardware();
     if(turnOffLeds) {
         printf("Turning off leds\n");
-        server.turnOffLeds();
+        while(!server.hardwareStarted())
+            usleep(1000);
+        for(auto board : server.boards)
+            board->turnOffLeds();
     } else {
-        server.initGame();
+        if(unixPath)
+            server.listenLocal(unixPath);
+        if(wsPort)
+            server.listenWebSocket(wsPort);
+        if(useShm)
+            server.enableShm();
+        if(metricsPort)
+            server.listenMetrics(metricsPort);
         server.startServer();
     }
     printf("%s finished\n",TITLE);
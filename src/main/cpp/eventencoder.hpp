@@ -0,0 +1,114 @@
+//
+// Renders the events the controller broadcasts straight into a reusable buffer,
+// without building a json object for each one.
+//
+
+#ifndef CONTROLLER_EVENTENCODER_HPP
+#define CONTROLLER_EVENTENCODER_HPP
+
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+/**
+ * Builds broadcast events from fixed templates. Every render method clears the
+ * buffer and writes one complete event, terminated with "\r\n", so the result
+ * can be written to each client as is. The buffer is reused between events, so
+ * once it has grown to fit the largest event no more memory is allocated.
+ *
+ * The returned string is only valid until the next render call.
+ */
+class EventEncoder {
+protected:
+    string m_buffer;
+
+    void appendSeq(int board,unsigned long seq) {
+        char buffer[48];
+        int n = snprintf(buffer,sizeof(buffer),",\"board\":%d,\"seq\":%lu}\r\n",board,seq);
+        m_buffer.append(buffer,n);
+    }
+
+    /** Appends s as a quoted json string. */
+    void appendString(const char* s) {
+        m_buffer += '"';
+        for(; *s; s++) {
+            unsigned char c = *s;
+            if(c == '"' || c == '\\') {
+                m_buffer += '\\';
+                m_buffer += c;
+            } else if(c < 0x20) {
+                char buffer[8];
+                snprintf(buffer,sizeof(buffer),"\\u%04x",c);
+                m_buffer += buffer;
+            } else {
+                m_buffer += c;
+            }
+        }
+        m_buffer += '"';
+    }
+
+public:
+    EventEncoder() {
+        m_buffer.reserve(256);
+    }
+
+    /** {"action":"pieceUp","square":"e2","board":0,"seq":1} or pieceDown if down is true. */
+    const string& piece(bool down,const char* square,int board,unsigned long seq) {
+        m_buffer.assign(down ? "{\"action\":\"pieceDown\",\"square\":\"" : "{\"action\":\"pieceUp\",\"square\":\"");
+        m_buffer += square;
+        m_buffer += '"';
+        appendSeq(board,seq);
+        return m_buffer;
+    }
+
+    /** {"action":"invalid_move","long":"e2e5","san":"e5","board":0,"seq":1} */
+    const string& invalidMove(const char* lan,const char* san,int board,unsigned long seq) {
+        m_buffer.assign("{\"action\":\"invalid_move\",\"long\":");
+        appendString(lan);
+        m_buffer += ",\"san\":";
+        appendString(san);
+        appendSeq(board,seq);
+        return m_buffer;
+    }
+
+    /** {"action":"move","description":null,"moves":[{"type":"move","from":"e2","to":"e4","long":"e2e4","san":"e4"}],"board":0,"seq":1} */
+    const string& move(const char* type,const char* from,const char* to,const char* lan,const char* san,int board,unsigned long seq) {
+        m_buffer.assign("{\"action\":\"move\",\"description\":null,\"moves\":[{\"type\":");
+        appendString(type);
+        m_buffer += ",\"from\":";
+        appendString(from);
+        m_buffer += ",\"to\":";
+        appendString(to);
+        m_buffer += ",\"long\":";
+        appendString(lan);
+        m_buffer += ",\"san\":";
+        appendString(san);
+        m_buffer += "}]";
+        appendSeq(board,seq);
+        return m_buffer;
+    }
+
+    /** The move the board was waiting for has been made, same fields as ChessMove::tojson(). */
+    const string& moveFinished(const char* from,const char* to,const char* type,const char* description,int board,unsigned long seq) {
+        m_buffer.assign("{\"from\":");
+        appendString(from);
+        m_buffer += ",\"to\":";
+        appendString(to);
+        m_buffer += ",\"type\":";
+        appendString(type);
+        m_buffer += ",\"descripton\":";
+        appendString(description);
+        appendSeq(board,seq);
+        return m_buffer;
+    }
+
+    /** {"action":"setposition","status":"complete","board":0,"seq":1} */
+    const string& setPositionComplete(int board,unsigned long seq) {
+        m_buffer.assign("{\"action\":\"setposition\",\"status\":\"complete\"");
+        appendSeq(board,seq);
+        return m_buffer;
+    }
+};
+
+#endif //CONTROLLER_EVENTENCODER_HPP
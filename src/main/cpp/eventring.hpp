@@ -0,0 +1,76 @@
+//
+// Keeps the most recent broadcast events so a client that lost its connection
+// can catch up on what it missed.
+//
+
+#ifndef CONTROLLER_EVENTRING_HPP
+#define CONTROLLER_EVENTRING_HPP
+
+#include <string>
+
+using namespace std;
+
+/**
+ * Fixed size ring of broadcast events, indexed by sequence number.
+ *
+ * Sequence numbers start at 1 and are contiguous, so the slot for an event is
+ * just seq % RING_SIZE. Once the ring wraps the oldest events are overwritten
+ * and a client that is further behind than that has to resync from a snapshot.
+ */
+class EventRing {
+public:
+    enum {RING_SIZE=256};
+
+protected:
+    string m_lines[RING_SIZE];
+    string m_frames[RING_SIZE];     ///< The same events as binary frames.
+    unsigned m_topics[RING_SIZE];   ///< Topic of each event, so a replay honours the client's subscriptions.
+    unsigned long m_last;       ///< Sequence number of the newest event, 0 when nothing has been sent yet.
+
+public:
+    EventRing() : m_last(0) {}
+
+    /** Sequence number the next event will be stamped with. */
+    unsigned long nextSeq() {return m_last+1;}
+
+    /** Sequence number of the newest event. */
+    unsigned long lastSeq() {return m_last;}
+
+    /** Sequence number of the oldest event still held in the ring. */
+    unsigned long firstSeq() {
+        return m_last < RING_SIZE ? 1 : m_last-RING_SIZE+1;
+    }
+
+    /** Stores the event stamped with nextSeq(), both as a json line and as a binary frame. */
+    void add(unsigned topic,const string& line,const string& frame) {
+        ++m_last;
+        m_lines[m_last%RING_SIZE] = line;
+        m_frames[m_last%RING_SIZE] = frame;
+        m_topics[m_last%RING_SIZE] = topic;
+    }
+
+    /**
+     * Returns true if every event after seq is still in the ring, meaning a
+     * client that last saw seq can be brought up to date by replaying them.
+     */
+    bool canReplay(unsigned long seq) {
+        return seq <= m_last && seq+1 >= firstSeq();
+    }
+
+    /** The event stamped with seq. Only valid for firstSeq() <= seq <= lastSeq(). */
+    const string& at(unsigned long seq) {
+        return m_lines[seq%RING_SIZE];
+    }
+
+    /** Binary frame of the event stamped with seq. Same limits as at(). */
+    const string& frame(unsigned long seq) {
+        return m_frames[seq%RING_SIZE];
+    }
+
+    /** Topic of the event stamped with seq. Same limits as at(). */
+    unsigned topic(unsigned long seq) {
+        return m_topics[seq%RING_SIZE];
+    }
+};
+
+#endif //CONTROLLER_EVENTRING_HPP
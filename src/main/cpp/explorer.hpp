@@ -0,0 +1,131 @@
+//
+// Opening explorer statistics, what was played from a position and how those games ended.
+//
+
+#ifndef CONTROLLER_EXPLORER_HPP
+#define CONTROLLER_EXPLORER_HPP
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+#include "thc.h"
+#include "binaryprotocol.hpp"
+#include "positionhash.hpp"
+
+#define EXPLORER_MAGIC "CLRX"
+#define EXPLORER_VERSION 1
+
+/** A move played from a position, and the results of the games it was played in. */
+struct ExplorerEntry {
+    uint64_t hash;              ///< positionHash() of the position the move was played from.
+    uint16_t move;              ///< Packed with packMove().
+    uint16_t reserved;
+    uint32_t count;             ///< Games, the ones without a result included.
+    uint32_t white;             ///< Games white won.
+    uint32_t draws;
+    uint32_t black;             ///< Games black won.
+    uint32_t reserved2;
+
+    bool operator<(const ExplorerEntry& other) const {
+        return hash != other.hash ? hash < other.hash : move < other.move;
+    }
+
+    /** Adds another entry's games, for the same position and move. */
+    void add(const ExplorerEntry& other) {
+        count += other.count;
+        white += other.white;
+        draws += other.draws;
+        black += other.black;
+    }
+};
+
+/** Start of the file, followed by the entries sorted by hash and then move. */
+struct ExplorerHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t games;             ///< Games the statistics were built from.
+    uint64_t entries;
+};
+
+/**
+ * A table written by chesslrindex, mapped read only. The entries for a position are next to
+ * each other, so looking a position up is one binary search, and only the pages it touches are
+ * read in however big the table is.
+ */
+class ExplorerTable {
+protected:
+    void* m_map;
+    size_t m_size;
+    const ExplorerHeader* m_header;
+    const ExplorerEntry* m_entries;
+
+public:
+    ExplorerTable() : m_map(NULL),m_size(0),m_header(NULL),m_entries(NULL) {}
+    ~ExplorerTable() {
+        if(m_map)
+            munmap(m_map,m_size);
+    }
+
+    bool open(const char* path) {
+        int fd = ::open(path,O_RDONLY);
+        if(fd < 0) {
+            perror(path);
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd,&st) < 0 || (size_t)st.st_size < sizeof(ExplorerHeader)) {
+            fprintf(stderr,"%s: not an explorer table\n",path);
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);
+        if(p == MAP_FAILED) {
+            perror(path);
+            return false;
+        }
+        const ExplorerHeader* header = (const ExplorerHeader*)p;
+        if(memcmp(header->magic,EXPLORER_MAGIC,4) || header->version != EXPLORER_VERSION
+                || sizeof(ExplorerHeader)+header->entries*sizeof(ExplorerEntry) != (size_t)st.st_size) {
+            fprintf(stderr,"%s: not an explorer table\n",path);
+            munmap(p,st.st_size);
+            return false;
+        }
+        madvise(p,st.st_size,MADV_RANDOM);
+        m_map = p;
+        m_size = st.st_size;
+        m_header = header;
+        m_entries = (const ExplorerEntry*)(header+1);
+        return true;
+    }
+
+    uint64_t games() {
+        return m_header ? m_header->games : 0;
+    }
+
+    uint64_t entries() {
+        return m_header ? m_header->entries : 0;
+    }
+
+    /** The moves played from the position, most played first. */
+    void lookup(thc::ChessPosition& position,vector<ExplorerEntry>& moves) {
+        if(!m_header)
+            return;
+        ExplorerEntry key;
+        memset(&key,0,sizeof(key));
+        key.hash = positionHash(position);
+        const ExplorerEntry* end = m_entries+m_header->entries;
+        for(const ExplorerEntry* it = std::lower_bound(m_entries,end,key); it != end && it->hash == key.hash; it++)
+            moves.push_back(*it);
+        std::sort(moves.begin(),moves.end(),[](const ExplorerEntry& a,const ExplorerEntry& b) {return a.count > b.count;});
+    }
+};
+
+#endif //CONTROLLER_EXPLORER_HPP
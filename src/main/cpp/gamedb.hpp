@@ -0,0 +1,466 @@
+//
+// The games played on the boards, kept on disk with an index of the positions they went through.
+//
+
+#ifndef CONTROLLER_GAMEDB_HPP
+#define CONTROLLER_GAMEDB_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#include "thc.h"
+#include "board.hpp"
+#include "binaryprotocol.hpp"
+#include "positionhash.hpp"
+#include "statefile.hpp"
+#include "log.hpp"
+
+#define GAMES_MAGIC "CLRG"
+#define INDEX_MAGIC "CLRI"
+#define INDEX_VERSION 1
+
+enum {GAME_UNFINISHED,GAME_WHITE_WINS,GAME_BLACK_WINS,GAME_DRAW};
+
+/** A game in the games file, followed by its moves packed with packMove(). */
+struct GameHeader {
+    char magic[4];
+    uint32_t crc;               ///< crc32 of the rest of the header and the moves.
+    uint64_t time;              ///< When it was stored, microseconds since the epoch.
+    uint16_t moveCount;
+    uint8_t result;             ///< GAME_UNFINISHED, GAME_WHITE_WINS, GAME_BLACK_WINS or GAME_DRAW.
+    uint8_t board;
+    uint32_t reserved;
+    StatePosition start;
+};
+
+/** A position a game went through: the game's number and how many half moves in it was. */
+struct IndexEntry {
+    uint64_t hash;              ///< positionHash() of the position.
+    uint32_t game;
+    uint16_t ply;
+    uint16_t reserved;
+
+    bool operator<(const IndexEntry& other) const {
+        if(hash != other.hash)
+            return hash < other.hash;
+        if(game != other.game)
+            return game < other.game;
+        return ply < other.ply;
+    }
+};
+
+/** Start of the index file, followed by the entries sorted by hash. */
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t games;             ///< The index covers the games numbered below this.
+    uint32_t reserved;
+    uint64_t entries;
+};
+
+/** A game that reached a position, see GameDb::find(). */
+struct GameHit {
+    uint32_t game;
+    uint16_t ply;
+    uint16_t moveCount;
+    uint8_t result;
+    uint8_t board;
+    uint64_t time;
+};
+
+/**
+ * Finished games, each appended to <path>.games as a GameHeader and its packed moves, and
+ * numbered in the order they were stored. Every position of every game goes into an index from
+ * position hash to game and ply, so the games that reached a position are found with a binary
+ * search rather than by playing through them.
+ *
+ * The index is two parts. <path>.index is sorted on disk and mapped, it can be hundreds of
+ * thousands of games without being read in. The games stored since it was written are indexed
+ * in memory. When those add up to MERGE_ENTRIES, a thread of its own merges them into a new
+ * index file, which replaces the old one with a rename once it's complete, and the controller
+ * picks it up in poll(). Games the index file doesn't cover are indexed again when the games
+ * file is opened, so nothing is lost if the controller stops before a merge.
+ */
+class GameDb {
+public:
+    enum {MERGE_ENTRIES=50000,WRITE_BATCH=4096};
+
+protected:
+    string m_path;
+    int m_gamesFd;
+    uint64_t m_gamesSize;
+    vector<uint64_t> m_offsets;         ///< Where each game starts in the games file.
+    void* m_map;
+    size_t m_mapSize;
+    const IndexEntry* m_entries;        ///< The index file's entries, sorted.
+    uint64_t m_entryCount;
+    uint32_t m_indexed;                 ///< Games the index file covers.
+    vector<IndexEntry> m_recent;        ///< Entries of the games since, sorted.
+    std::thread m_merger;
+    bool m_merging;
+    bool m_mergeDone;                   ///< Set by the merge thread.
+    bool m_mergeOk;
+    uint32_t m_mergeGames;              ///< Games the index being merged covers.
+
+    static uint32_t checksum(const GameHeader& header,const uint16_t* moves) {
+        const Bytef* start = (const Bytef*)&header.crc+sizeof(header.crc);
+        uLong crc = crc32(0,start,(const Bytef*)(&header+1)-start);
+        return (uint32_t)crc32(crc,(const Bytef*)moves,header.moveCount*sizeof(uint16_t));
+    }
+
+    /** Adds an entry for each position of the game, the start included. */
+    static void indexGame(uint32_t game,const GameHeader& header,const uint16_t* moves,vector<IndexEntry>& entries) {
+        thc::ChessRules rules;
+        thc::ChessPosition start;
+        start.Decompress(header.start.position);
+        start.half_move_clock = header.start.halfMoveClock;
+        start.full_move_count = header.start.fullMoveCount;
+        rules = start;
+        IndexEntry entry;
+        entry.game = game;
+        entry.reserved = 0;
+        for(int ply=0;; ply++) {
+            entry.hash = positionHash(rules);
+            entry.ply = (uint16_t)ply;
+            entries.push_back(entry);
+            thc::Move mv;
+            if(ply == header.moveCount || !unpackMove(rules,moves[ply],mv))
+                break;
+            rules.PlayMove(mv);
+        }
+    }
+
+    /** Adds entries to m_recent, keeping it sorted. */
+    void addRecent(vector<IndexEntry>& entries) {
+        size_t middle = m_recent.size();
+        std::sort(entries.begin(),entries.end());
+        m_recent.insert(m_recent.end(),entries.begin(),entries.end());
+        std::inplace_merge(m_recent.begin(),m_recent.begin()+middle,m_recent.end());
+    }
+
+    void unmapIndex() {
+        if(m_map)
+            munmap(m_map,m_mapSize);
+        m_map = NULL;
+        m_entries = NULL;
+        m_entryCount = 0;
+        m_indexed = 0;
+    }
+
+    /** Maps the index file, if there is a good one. */
+    void mapIndex() {
+        unmapIndex();
+        string path = m_path+".index";
+        int fd = ::open(path.c_str(),O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(fstat(fd,&st) == 0 && (size_t)st.st_size >= sizeof(IndexHeader)) {
+            void* p = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+            if(p != MAP_FAILED) {
+                const IndexHeader* header = (const IndexHeader*)p;
+                if(!memcmp(header->magic,INDEX_MAGIC,4) && header->version == INDEX_VERSION
+                        && sizeof(IndexHeader)+header->entries*sizeof(IndexEntry) == (size_t)st.st_size) {
+                    m_map = p;
+                    m_mapSize = st.st_size;
+                    m_entries = (const IndexEntry*)(header+1);
+                    m_entryCount = header->entries;
+                    m_indexed = header->games;
+                    madvise(p,st.st_size,MADV_RANDOM);
+                } else {
+                    munmap(p,st.st_size);
+                    LOG_WARN("%s isn't an index, it will be rebuilt",path.c_str());
+                }
+            }
+        }
+        close(fd);
+    }
+
+    /**
+     * Finds where each game starts, checking the ones the index doesn't cover and indexing
+     * them. A game that didn't make it to disk whole is cut off.
+     */
+    bool scanGames() {
+        struct stat st;
+        if(fstat(m_gamesFd,&st) < 0)
+            return false;
+        uint64_t size = st.st_size;
+        const char* data = NULL;
+        if(size) {
+            void* p = mmap(NULL,size,PROT_READ,MAP_SHARED,m_gamesFd,0);
+            if(p == MAP_FAILED)
+                return false;
+            data = (const char*)p;
+            madvise(p,size,MADV_SEQUENTIAL);
+        }
+        uint64_t offset=0;
+        vector<IndexEntry> entries;
+        while(offset+sizeof(GameHeader) <= size) {
+            GameHeader header;
+            memcpy(&header,data+offset,sizeof(header));     //games after an odd number of moves aren't 8 byte aligned
+            const uint16_t* moves = (const uint16_t*)(data+offset+sizeof(header));
+            uint64_t length = sizeof(GameHeader)+header.moveCount*sizeof(uint16_t);
+            if(memcmp(header.magic,GAMES_MAGIC,4) || offset+length > size)
+                break;
+            uint32_t game = m_offsets.size();
+            if(game >= m_indexed) {
+                if(header.crc != checksum(header,moves))
+                    break;
+                indexGame(game,header,moves,entries);
+            }
+            m_offsets.push_back(offset);
+            offset += length;
+        }
+        if(data)
+            munmap((void*)data,size);
+        if(m_indexed > m_offsets.size()) {
+            //the games file is shorter than the index says, start the index over
+            LOG_WARN("%s.index has games that aren't in %s.games, rebuilding it",m_path.c_str(),m_path.c_str());
+            unmapIndex();
+            m_offsets.clear();
+            return scanGames();
+        }
+        if(offset != size) {
+            LOG_WARN("%s.games: dropping %llu bytes after game %u that didn't make it to disk whole",
+                     m_path.c_str(),(unsigned long long)(size-offset),(unsigned)m_offsets.size());
+            if(ftruncate(m_gamesFd,offset) < 0)
+                return false;
+        }
+        m_gamesSize = offset;
+        addRecent(entries);
+        return true;
+    }
+
+    /** Writes the index file's entries merged with recent into a new index file. Runs on the merge thread. */
+    void merge(vector<IndexEntry>* recent,uint32_t games) {
+        string path = m_path+".index";
+        string tmp = path+".tmp";
+        bool ok=false;
+        FILE* file = fopen(tmp.c_str(),"wb");
+        if(file) {
+            IndexHeader header;
+            memset(&header,0,sizeof(header));
+            memcpy(header.magic,INDEX_MAGIC,4);
+            header.version = INDEX_VERSION;
+            header.games = games;
+            header.entries = m_entryCount+recent->size();
+            ok = fwrite(&header,sizeof(header),1,file) == 1;
+            vector<IndexEntry> batch;
+            batch.reserve(WRITE_BATCH);
+            const IndexEntry* a = m_entries;
+            const IndexEntry* aEnd = m_entries+m_entryCount;
+            vector<IndexEntry>::iterator b = recent->begin();
+            while(ok && (a != aEnd || b != recent->end())) {
+                if(b == recent->end() || (a != aEnd && !(*b < *a)))
+                    batch.push_back(*a++);
+                else
+                    batch.push_back(*b++);
+                if(batch.size() == WRITE_BATCH || (a == aEnd && b == recent->end())) {
+                    ok = fwrite(batch.data(),sizeof(IndexEntry),batch.size(),file) == batch.size();
+                    batch.clear();
+                }
+            }
+            ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+            ok = fclose(file) == 0 && ok;
+            ok = ok && rename(tmp.c_str(),path.c_str()) == 0;
+            if(!ok)
+                unlink(tmp.c_str());
+        }
+        delete recent;
+        m_mergeOk = ok;
+        __atomic_store_n(&m_mergeDone,true,__ATOMIC_RELEASE);
+    }
+
+    void startMerge() {
+        m_merging = true;
+        m_mergeDone = false;
+        m_mergeGames = m_offsets.size();
+        vector<IndexEntry>* recent = new vector<IndexEntry>(m_recent);
+        m_merger = std::thread(&GameDb::merge,this,recent,m_mergeGames);
+    }
+
+    /** Adds the games from the two sorted parts of the index that reached the hash. */
+    void findIn(const IndexEntry* first,const IndexEntry* last,uint64_t hash,size_t limit,vector<IndexEntry>& found,size_t& count) {
+        IndexEntry key;
+        memset(&key,0,sizeof(key));
+        key.hash = hash;
+        const IndexEntry* it = std::lower_bound(first,last,key);
+        for(; it != last && it->hash == hash; it++) {
+            if(found.size() < limit)
+                found.push_back(*it);
+            count++;
+        }
+    }
+
+public:
+    GameDb() : m_gamesFd(-1),m_gamesSize(0),m_map(NULL),m_mapSize(0),m_entries(NULL),m_entryCount(0),m_indexed(0),
+               m_merging(false),m_mergeDone(false),m_mergeOk(false),m_mergeGames(0) {}
+
+    ~GameDb() {
+        if(m_merger.joinable())
+            m_merger.join();
+        unmapIndex();
+        if(m_gamesFd >= 0)
+            close(m_gamesFd);
+    }
+
+    /** Opens <path>.games and <path>.index, creating them if they aren't there. */
+    bool open(const char* path) {
+        m_path = path;
+        string games = m_path+".games";
+        m_gamesFd = ::open(games.c_str(),O_RDWR|O_CREAT|O_APPEND,0644);
+        if(m_gamesFd < 0) {
+            perror(games.c_str());
+            return false;
+        }
+        uint64_t start = monotonicMicros();
+        mapIndex();
+        if(!scanGames()) {
+            perror(games.c_str());
+            return false;
+        }
+        LOG_INFO("%s has %u games, %llu positions indexed and %u recent, opened in %.1f ms",games.c_str(),(unsigned)m_offsets.size(),
+                 (unsigned long long)m_entryCount,(unsigned)m_recent.size(),(monotonicMicros()-start)/1000.0);
+        if(m_recent.size() >= MERGE_ENTRIES)
+            startMerge();
+        return true;
+    }
+
+    size_t gameCount() {
+        return m_offsets.size();
+    }
+
+    /** How a game in the position stands, as a GAME_ result. */
+    static int result(BoardRules& rules) {
+        thc::TERMINAL terminal;
+        rules.Evaluate(terminal);
+        switch(terminal) {
+            case thc::TERMINAL_WCHECKMATE: return GAME_BLACK_WINS;
+            case thc::TERMINAL_BCHECKMATE: return GAME_WHITE_WINS;
+            case thc::TERMINAL_WSTALEMATE:
+            case thc::TERMINAL_BSTALEMATE: return GAME_DRAW;
+            default: break;
+        }
+        thc::DRAWTYPE draw;
+        return rules.IsDraw(rules.WhiteToPlay(),draw) ? GAME_DRAW : GAME_UNFINISHED;
+    }
+
+    static const char* resultName(int result) {
+        switch(result) {
+            case GAME_WHITE_WINS: return "1-0";
+            case GAME_BLACK_WINS: return "0-1";
+            case GAME_DRAW: return "1/2-1/2";
+        }
+        return "*";
+    }
+
+    /**
+     * Appends the board's game and indexes it.
+     * @return The game's number, or -1 if it couldn't be written.
+     */
+    int store(Board* board) {
+        if(m_gamesFd < 0)
+            return -1;
+        size_t count = board->played.size();
+        if(count > 0xffff)
+            count = 0xffff;
+        vector<char> buffer(sizeof(GameHeader)+count*sizeof(uint16_t));
+        GameHeader* header = (GameHeader*)buffer.data();
+        uint16_t* moves = (uint16_t*)(header+1);
+        memcpy(header->magic,GAMES_MAGIC,4);
+        header->time = frameTime();
+        header->moveCount = (uint16_t)count;
+        header->result = (uint8_t)result(board->rules);
+        header->board = (uint8_t)board->id;
+        header->reserved = 0;
+        memset(&header->start,0,sizeof(header->start));
+        board->startPosition.Compress(header->start.position);
+        header->start.halfMoveClock = (uint16_t)board->startPosition.half_move_clock;
+        header->start.fullMoveCount = (uint16_t)board->startPosition.full_move_count;
+        for(size_t i=0; i<count; i++)
+            moves[i] = packMove(board->played[i]);
+        header->crc = checksum(*header,moves);
+        ssize_t written = ::write(m_gamesFd,buffer.data(),buffer.size());
+        if(written != (ssize_t)buffer.size()) {
+            LOG_ERROR("%s.games: %s",m_path.c_str(),written < 0 ? strerror(errno) : "short write");
+            if(written > 0 && ftruncate(m_gamesFd,m_gamesSize) < 0)
+                LOG_ERROR("%s.games: %s",m_path.c_str(),strerror(errno));
+            return -1;
+        }
+        uint32_t game = m_offsets.size();
+        m_offsets.push_back(m_gamesSize);
+        m_gamesSize += buffer.size();
+        vector<IndexEntry> entries;
+        indexGame(game,*header,moves,entries);
+        addRecent(entries);
+        LOG_INFO("board %d game %u stored, %u moves %s",board->id,game,(unsigned)count,resultName(header->result));
+        if(!m_merging && m_recent.size() >= MERGE_ENTRIES)
+            startMerge();
+        return game;
+    }
+
+    /**
+     * The games that reached the position, up to limit of them, oldest first.
+     * @return How many times the position was reached in all, which can be more than limit.
+     */
+    size_t find(thc::ChessPosition& position,size_t limit,vector<GameHit>& hits) {
+        uint64_t hash = positionHash(position);
+        vector<IndexEntry> found;
+        size_t count=0;
+        findIn(m_entries,m_entries+m_entryCount,hash,limit,found,count);
+        findIn(m_recent.data(),m_recent.data()+m_recent.size(),hash,limit,found,count);
+        for(size_t i=0; i<found.size(); i++) {
+            GameHeader header;
+            if(found[i].game >= m_offsets.size() ||
+                    pread(m_gamesFd,&header,sizeof(header),m_offsets[found[i].game]) != (ssize_t)sizeof(header))
+                continue;
+            GameHit hit;
+            hit.game = found[i].game;
+            hit.ply = found[i].ply;
+            hit.moveCount = header.moveCount;
+            hit.result = header.result;
+            hit.board = header.board;
+            hit.time = header.time;
+            hits.push_back(hit);
+        }
+        return count;
+    }
+
+    /** Reads a game back. */
+    bool load(uint32_t game,GameHeader& header,vector<uint16_t>& moves) {
+        if(game >= m_offsets.size() || pread(m_gamesFd,&header,sizeof(header),m_offsets[game]) != (ssize_t)sizeof(header))
+            return false;
+        moves.resize(header.moveCount);
+        size_t length = header.moveCount*sizeof(uint16_t);
+        return pread(m_gamesFd,moves.data(),length,m_offsets[game]+sizeof(header)) == (ssize_t)length;
+    }
+
+    /** Picks up an index file the merge thread has finished. Call it regularly, from the same thread as store(). */
+    void poll() {
+        if(!m_merging || !__atomic_load_n(&m_mergeDone,__ATOMIC_ACQUIRE))
+            return;
+        m_merger.join();
+        m_merging = false;
+        if(!m_mergeOk) {
+            LOG_ERROR("%s.index: merging the recent games failed",m_path.c_str());
+            return;
+        }
+        mapIndex();
+        uint32_t games = m_indexed;
+        m_recent.erase(std::remove_if(m_recent.begin(),m_recent.end(),[games](const IndexEntry& e) {return e.game < games;}),m_recent.end());
+        LOG_INFO("%s.index now covers %u games, %llu positions",m_path.c_str(),games,(unsigned long long)m_entryCount);
+    }
+};
+
+#endif //CONTROLLER_GAMEDB_HPP
@@ -0,0 +1,279 @@
+//
+// A board driven straight through the kernel's i2c-dev interface, without wiringPi.
+//
+
+#ifndef CONTROLLER_I2CDEV_HPP
+#define CONTROLLER_I2CDEV_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <map>
+#include <string>
+
+#include "boardio.hpp"
+#include "log.hpp"
+
+/**
+ * An McpBoardIO talking to /dev/i2c-N directly instead of through wiringPi. wiringPi reads a
+ * pin at a time, a bus transaction per square; this reads GPIOA of all eight chips in one
+ * I2C_RDWR, a register write and a one byte read per chip joined by repeated starts, so a scan
+ * is one system call. When a chip fails that call, the chips are read one at a time to find
+ * which. LED writes go the same way: setLeds() writes OLATB of just the rows that changed, in
+ * one call, leaving out chips that are down.
+ *
+ * Not every bus driver takes more than one read in a transfer; the Pi's i2c-bcm2835 only takes
+ * a read as the last message and fails anything else with EOPNOTSUPP. The first time that
+ * happens the board goes over to a write and read transfer per chip for good, eight system
+ * calls a scan, and it isn't counted as a bus error.
+ *
+ * A board behind a multiplexer selects its channel with a write of its own, ended with a stop,
+ * before the chips are talked to; the TCA9548A only switches channels on the stop. The channel
+ * selected is remembered per bus, so while one board is in use the write is left out, and it's
+ * only made again when another board on the bus was used in between or a transfer failed.
+ */
+class I2cDevIO : public McpBoardIO {
+protected:
+    const char* m_path;
+    int m_fd;
+    uint64_t m_lit;             ///< LEDs as last written, bit n for square n.
+    bool m_litUnknown;          ///< The chips kept their LEDs from before a restart, so m_lit can't be trusted.
+    uint8_t m_muxByte;
+    uint8_t m_gpioa;            ///< The register address written before each read.
+    bool m_batchReads;          ///< The driver takes several reads in one transfer, until it says it doesn't.
+
+    /**
+     * The multiplexer and channel last selected on each bus, as muxAddress<<8|channel byte, by
+     * path. The boards are only used from one thread at a time, so it isn't locked.
+     */
+    static std::map<std::string,int>& selected() {
+        static std::map<std::string,int> buses;
+        return buses;
+    }
+
+    /** Selects the board's channel, unless it's the one the bus was left on. */
+    bool selectChannel() {
+        if(!muxAddress)
+            return true;
+        int want = muxAddress<<8 | m_muxByte;
+        int& current = selected()[m_path];
+        if(current == want)
+            return true;
+        struct i2c_msg msg;
+        msg.addr = muxAddress;
+        msg.flags = 0;
+        msg.len = 1;
+        msg.buf = &m_muxByte;
+        struct i2c_rdwr_ioctl_data data;
+        data.msgs = &msg;
+        data.nmsgs = 1;
+        if(ioctl(m_fd,I2C_RDWR,&data) < 0) {
+            current = 0;
+            busErrors++;
+            return false;
+        }
+        current = want;
+        return true;
+    }
+
+    bool rdwr(struct i2c_msg* msgs,int n) {
+        struct i2c_rdwr_ioctl_data data;
+        data.msgs = msgs;
+        data.nmsgs = n;
+        return ioctl(m_fd,I2C_RDWR,&data) >= 0;
+    }
+
+    void transferFailed() {
+        if(muxAddress)
+            selected()[m_path] = 0;     //the multiplexer may have been reset, select it again
+        busErrors++;
+    }
+
+    /** Sends the messages as transfers that each end with a read, the most some drivers take. */
+    bool transferEach(struct i2c_msg* msgs,int n) {
+        for(int first=0; first<n;) {
+            int last=first;
+            while(last < n-1 && !(msgs[last].flags&I2C_M_RD))
+                last++;
+            if(!rdwr(msgs+first,last-first+1)) {
+                transferFailed();
+                return false;
+            }
+            first = last+1;
+        }
+        return true;
+    }
+
+    bool transfer(struct i2c_msg* msgs,int n) {
+        if(m_fd < 0 || !selectChannel())
+            return false;
+        int reads=0;
+        for(int i=0; i<n; i++)
+            reads += (msgs[i].flags&I2C_M_RD) != 0;
+        if(reads > 1 && !m_batchReads)
+            return transferEach(msgs,n);
+        if(rdwr(msgs,n))
+            return true;
+        if(reads > 1 && errno == EOPNOTSUPP) {
+            LOG_INFO("%s takes one read per transfer, reading the chips one at a time",m_path);
+            m_batchReads = false;
+            return transferEach(msgs,n);
+        }
+        transferFailed();
+        return false;
+    }
+
+    /** Adds a register address write and a one byte read of a chip. */
+    void addRead(struct i2c_msg* msgs,int& n,int row,uint8_t* reg,uint8_t* value) {
+        msgs[n].addr = FIRST_CHIP+row;
+        msgs[n].flags = 0;
+        msgs[n].len = 1;
+        msgs[n].buf = reg;
+        n++;
+        msgs[n].addr = FIRST_CHIP+row;
+        msgs[n].flags = I2C_M_RD;
+        msgs[n].len = 1;
+        msgs[n].buf = value;
+        n++;
+    }
+
+    /** Writes one register of one chip. */
+    bool writeRegister(int row,uint8_t reg,uint8_t value) {
+        struct i2c_msg msg;
+        uint8_t buffer[2] = {reg,value};
+        msg.addr = FIRST_CHIP+row;
+        msg.flags = 0;
+        msg.len = sizeof(buffer);
+        msg.buf = buffer;
+        return transfer(&msg,1);
+    }
+
+    bool readRegister(int row,uint8_t reg,uint8_t& value) {
+        struct i2c_msg msgs[2];
+        int n=0;
+        addRead(msgs,n,row,&reg,&value);
+        return transfer(msgs,n);
+    }
+
+    /** Reads IODIRA through GPPUA of every chip in one transfer, or one a chip, rather than three reads a chip. */
+    bool readConfig(uint8_t config[ROWS][MCP_GPPUA+1]) {
+        struct i2c_msg msgs[2*ROWS];
+        uint8_t first = MCP_IODIRA;
+        int n=0;
+        for(int row=0; row<ROWS; row++) {
+            addRead(msgs,n,row,&first,config[row]);
+            msgs[n-1].len = MCP_GPPUA+1;
+        }
+        return transfer(msgs,n);
+    }
+
+    bool readAll(uint8_t* inputs) {
+        struct i2c_msg msgs[2*ROWS];
+        int n=0;
+        for(int row=0; row<ROWS; row++)
+            addRead(msgs,n,row,&m_gpioa,&inputs[row]);
+        return transfer(msgs,n);
+    }
+
+    bool readRow(int row,uint8_t& inputs) {
+        return readRegister(row,MCP_GPIOA,inputs);
+    }
+
+    /**
+     * Clears IOCON too, since wiringPi sets SEQOP, which stops readConfig() from reading
+     * consecutive registers. LEDs are set from m_lit, so a chip that comes back shows what it
+     * did before it failed.
+     */
+    bool configureRow(int row) {
+        return writeRegister(row,MCP_IOCON,0) && writeRegister(row,MCP_IODIRA,0xff) && writeRegister(row,MCP_GPPUA,0xff)
+                && writeRegister(row,MCP_OLATB,rowLeds(m_lit,row)) && writeRegister(row,MCP_IODIRB,0);
+    }
+
+    /** The OLATB byte that lights a row: column c is wired to GPB(7-c). */
+    static uint8_t rowLeds(uint64_t on,int row) {
+        uint8_t bits = (uint8_t)(on>>(row*8));
+        uint8_t reversed=0;
+        for(int col=0; col<8; col++) {
+            if(bits&(1<<col))
+                reversed |= 0x80>>col;
+        }
+        return reversed;
+    }
+
+public:
+    /**
+     * @param path The bus, like /dev/i2c-1.
+     * @param swap Swap the two reed switches that are wired the wrong way round on the first board.
+     */
+    I2cDevIO(const char* path,int mux,int channel,bool swap)
+            : McpBoardIO(mux,channel,swap),m_path(path),m_fd(-1),m_lit(0),m_litUnknown(false),
+              m_muxByte((uint8_t)(1<<channel)),m_gpioa(MCP_GPIOA),m_batchReads(true) {}
+
+    ~I2cDevIO() {
+        if(m_fd >= 0)
+            close(m_fd);
+    }
+
+    /**
+     * Opens the bus and configures the chips that need it. A chip that kept its settings keeps
+     * its LEDs too, until the first setLeds(), which writes every row.
+     */
+    void setup() {
+        m_fd = open(m_path,O_RDWR);
+        if(m_fd < 0) {
+            perror(m_path);
+            busErrors++;
+            return;
+        }
+        m_litUnknown = true;
+        uint8_t config[ROWS][MCP_GPPUA+1];
+        if(!readConfig(config)) {
+            configureChips();       //a chip is missing, find out which one at a time
+            return;
+        }
+        int skipped=0;
+        for(int row=0; row<ROWS; row++) {
+            if(config[row][MCP_IOCON] == 0 && config[row][MCP_IODIRA] == 0xff && config[row][MCP_IODIRB] == 0 && config[row][MCP_GPPUA] == 0xff)
+                skipped++;
+            else if(!configureRow(row))
+                chipFailed(row);
+        }
+        LOG_INFO("%s mux 0x%02x channel %d: %d of %d chips were already configured",m_path,muxAddress,muxChannel,skipped,ROWS);
+    }
+
+    void setLed(int index,int on) {
+        setLeds(on ? m_lit|1ULL<<index : m_lit&~(1ULL<<index));
+    }
+
+    void setLeds(uint64_t on) {
+        struct i2c_msg msgs[ROWS];
+        uint8_t buffers[ROWS][2];
+        uint64_t written = m_lit;
+        int n=0;
+        for(int row=0; row<ROWS; row++) {
+            uint64_t rowMask = 0xffULL<<(row*8);
+            if((!m_litUnknown && !((on^m_lit)&rowMask)) || !chips[row].up)
+                continue;
+            buffers[row][0] = MCP_OLATB;
+            buffers[row][1] = rowLeds(on,row);
+            msgs[n].addr = FIRST_CHIP+row;
+            msgs[n].flags = 0;
+            msgs[n].len = 2;
+            msgs[n].buf = buffers[row];
+            n++;
+            written = (written&~rowMask) | (on&rowMask);
+        }
+        if(n > 0 && transfer(msgs,n)) {
+            m_lit = written;
+            m_litUnknown = false;
+        }
+    }
+};
+
+#endif //CONTROLLER_I2CDEV_HPP
@@ -0,0 +1,310 @@
+//
+// An append only journal of the moves and positions the boards accept, synced to disk in batches.
+//
+
+#ifndef CONTROLLER_JOURNAL_HPP
+#define CONTROLLER_JOURNAL_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <thread>
+#include <zlib.h>
+
+#include "thc.h"
+#include "binaryprotocol.hpp"
+#include "statefile.hpp"
+#include "positionhash.hpp"
+#include "log.hpp"
+
+#define JOURNAL_MAGIC "CLRJ"
+#define JOURNAL_VERSION 1       ///< Goes up when the records change, positionHash() included.
+
+enum {
+    JOURNAL_MOVE=1,             ///< A move was played, move is what was played from the position hashed.
+    JOURNAL_TAKEBACK=2,         ///< The player took a move back when asked to, move has its from and to.
+    JOURNAL_POSITION=3          ///< The board was given a position, it's in position.
+};
+
+/** Start of the file, followed by the records. */
+struct JournalHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;        ///< sizeof(JournalRecord), so a file from a different build isn't misread.
+    uint32_t reserved;
+};
+
+/** One entry, 64 bytes on disk, little endian like the Pi. */
+struct JournalRecord {
+    uint32_t crc;               ///< crc32 of everything after this field.
+    uint32_t seq;               ///< One more than the record before it, from 1.
+    uint64_t time;              ///< Microseconds since the epoch, see frameTime().
+    uint64_t hash;              ///< positionHash() of the position before the entry was applied.
+    uint8_t board;
+    uint8_t kind;               ///< JOURNAL_MOVE, JOURNAL_TAKEBACK or JOURNAL_POSITION.
+    uint16_t reserved;
+    thc::Move move;
+    StatePosition position;     ///< Only for JOURNAL_POSITION, zero otherwise.
+    uint8_t padding[4];
+};
+
+/**
+ * Records are handed to a thread of their own through a fixed ring, the same way the logger
+ * does it, so an append is filling in 64 bytes and never waits for the disk. The thread writes
+ * whatever has queued up with one write() and makes it durable with one fdatasync(), so moves
+ * that come in while a sync is going on share the next one. Only an entry that hasn't been
+ * synced yet can be lost when the power goes.
+ *
+ * Opening the journal checks the records already there and cuts off a torn one at the end, so
+ * appending carries on from the last good record. A write that fails part way through a record
+ * is cut off the same way, and the records that didn't make it are written again next time.
+ */
+class Journal {
+public:
+    enum {SLOTS=256,IDLE_US=2000};
+
+protected:
+    int m_fd;
+    off_t m_end;                ///< Length of the file up to the last whole record written.
+    bool m_torn;                ///< A part of a record is after m_end, it has to go before anything else is written.
+    JournalRecord m_slots[SLOTS];
+    uint64_t m_head;            ///< Next slot to fill, only the appending thread touches this.
+    uint64_t m_tail;            ///< Next slot to write, published by the writer thread.
+    uint32_t m_seq;             ///< seq of the last record appended.
+    bool m_running;
+    std::thread m_thread;
+
+    static uint32_t checksum(const JournalRecord& record) {
+        const Bytef* start = (const Bytef*)&record.crc+sizeof(record.crc);
+        return (uint32_t)crc32(0,start,(const Bytef*)(&record+1)-start);
+    }
+
+    /** Cuts the file back to the last whole record. */
+    bool cutTorn() {
+        if(ftruncate(m_fd,m_end) < 0) {
+            __atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+            return false;
+        }
+        m_torn = false;
+        return true;
+    }
+
+    /**
+     * Writes and syncs what's queued, returns how many records that was. Only the records
+     * written whole leave the ring, the rest are tried again.
+     */
+    int drain() {
+        if(m_torn && !cutTorn())
+            return 0;
+        uint64_t tail = m_tail;
+        uint64_t head = __atomic_load_n(&m_head,__ATOMIC_ACQUIRE);
+        if(head == tail)
+            return 0;
+        if(head-tail > SLOTS-tail%SLOTS)
+            head = tail+SLOTS-tail%SLOTS;   //up to the end of the ring, the rest goes next time
+        JournalRecord* first = &m_slots[tail%SLOTS];
+        size_t n = head-tail;
+        for(size_t i=0; i<n; i++)
+            first[i].crc = checksum(first[i]);
+        uint64_t start = monotonicMicros();
+        const char* p = (const char*)first;
+        size_t left = n*sizeof(JournalRecord);
+        while(left) {
+            ssize_t wrote = ::write(m_fd,p,left);
+            if(wrote < 0 && errno == EINTR)
+                continue;
+            if(wrote <= 0) {
+                __atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+                break;
+            }
+            p += wrote;
+            left -= wrote;
+        }
+        size_t bytes = n*sizeof(JournalRecord)-left;
+        size_t whole = bytes/sizeof(JournalRecord);
+        m_end += whole*sizeof(JournalRecord);
+        if(bytes%sizeof(JournalRecord)) {
+            m_torn = true;
+            cutTorn();
+        }
+        if(!bytes)
+            return 0;
+        if(fdatasync(m_fd) < 0)
+            __atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+        __atomic_store_n(&lastSyncMicros,monotonicMicros()-start,__ATOMIC_RELAXED);
+        __atomic_add_fetch(&syncs,1,__ATOMIC_RELAXED);
+        __atomic_add_fetch(&written,whole,__ATOMIC_RELAXED);
+        __atomic_store_n(&m_tail,tail+whole,__ATOMIC_RELEASE);
+        return (int)whole;
+    }
+
+    void run() {
+        while(__atomic_load_n(&m_running,__ATOMIC_ACQUIRE)) {
+            if(!drain())
+                usleep(IDLE_US);
+        }
+        while(drain())
+            ;
+    }
+
+    /** Claims the next slot, or returns NULL and counts the entry as dropped if the ring is full. */
+    JournalRecord* claim(int board,int kind) {
+        if(m_fd < 0)
+            return NULL;
+        if(m_head-__atomic_load_n(&m_tail,__ATOMIC_ACQUIRE) >= SLOTS) {
+            __atomic_add_fetch(&dropped,1,__ATOMIC_RELAXED);
+            return NULL;
+        }
+        JournalRecord* record = &m_slots[m_head%SLOTS];
+        memset(record,0,sizeof(*record));
+        record->seq = ++m_seq;
+        record->time = frameTime();
+        record->board = (uint8_t)board;
+        record->kind = (uint8_t)kind;
+        return record;
+    }
+
+    void publish() {
+        __atomic_store_n(&m_head,m_head+1,__ATOMIC_RELEASE);
+    }
+
+public:
+    uint64_t written;           ///< Records written, updated by the writer thread.
+    uint64_t syncs;             ///< fdatasync() calls, each one covers every record written before it.
+    uint64_t lastSyncMicros;    ///< How long the last write and sync took.
+    uint64_t dropped;           ///< Entries lost because the writer fell SLOTS behind.
+    uint64_t errors;            ///< Failed writes and syncs.
+
+    Journal() : m_fd(-1),m_end(0),m_torn(false),m_head(0),m_tail(0),m_seq(0),m_running(false),
+                written(0),syncs(0),lastSyncMicros(0),dropped(0),errors(0) {}
+
+    ~Journal() {
+        if(m_running) {
+            __atomic_store_n(&m_running,false,__ATOMIC_RELEASE);
+            m_thread.join();
+        }
+        if(m_fd >= 0)
+            close(m_fd);
+    }
+
+    /** Whether the file starts with a header for this version of the records. */
+    static bool readHeader(int fd) {
+        JournalHeader header;
+        return pread(fd,&header,sizeof(header),0) == (ssize_t)sizeof(header) && !memcmp(header.magic,JOURNAL_MAGIC,4)
+                && header.version == JOURNAL_VERSION && header.recordSize == sizeof(JournalRecord);
+    }
+
+    /**
+     * Reads the good records of a journal, stopping at the first one that's torn or out of
+     * sequence.
+     * @return The length of the file that holds the header and the good records, 0 if the header isn't right.
+     */
+    static off_t readRecords(int fd,vector<JournalRecord>* records,uint32_t& lastSeq) {
+        JournalRecord record;
+        off_t good=sizeof(JournalHeader);
+        lastSeq=0;
+        if(!readHeader(fd))
+            return 0;
+        while(pread(fd,&record,sizeof(record),good) == (ssize_t)sizeof(record)) {
+            if(record.crc != checksum(record) || record.seq != lastSeq+1)
+                break;
+            if(records)
+                records->push_back(record);
+            lastSeq = record.seq;
+            good += sizeof(record);
+        }
+        return good;
+    }
+
+    /**
+     * Opens or creates the journal and starts the writer thread. A file that doesn't start
+     * with a journal header for these records isn't touched.
+     */
+    bool open(const char* path) {
+        m_fd = ::open(path,O_RDWR|O_CREAT|O_APPEND,0644);
+        if(m_fd < 0) {
+            perror(path);
+            return false;
+        }
+        struct stat st;
+        if(fstat(m_fd,&st) < 0) {
+            perror(path);
+            return false;
+        }
+        if((size_t)st.st_size < sizeof(JournalHeader)) {
+            //new, or its header never made it to disk
+            JournalHeader header;
+            memset(&header,0,sizeof(header));
+            memcpy(header.magic,JOURNAL_MAGIC,4);
+            header.version = JOURNAL_VERSION;
+            header.recordSize = sizeof(JournalRecord);
+            if(ftruncate(m_fd,0) < 0 || ::write(m_fd,&header,sizeof(header)) != (ssize_t)sizeof(header) || fdatasync(m_fd) < 0) {
+                perror(path);
+                return false;
+            }
+            st.st_size = sizeof(header);
+        }
+        off_t good = readRecords(m_fd,NULL,m_seq);
+        if(!good) {
+            LOG_ERROR("%s isn't a journal of this version, move it out of the way to start a new one",path);
+            return false;
+        }
+        if(good != st.st_size) {
+            LOG_WARN("%s: dropping %lld bytes after record %u that didn't make it to disk whole",
+                     path,(long long)(st.st_size-good),m_seq);
+            if(ftruncate(m_fd,good) < 0 || fdatasync(m_fd) < 0) {
+                perror(path);
+                return false;
+            }
+        }
+        m_end = good;
+        LOG_INFO("%s has %u records",path,m_seq);
+        m_running = true;
+        m_thread = std::thread(&Journal::run,this);
+        return true;
+    }
+
+    bool opened() {
+        return m_fd >= 0;
+    }
+
+    /** A move about to be played in the position. */
+    void move(int board,thc::ChessPosition& position,thc::Move mv) {
+        JournalRecord* record = claim(board,JOURNAL_MOVE);
+        if(!record)
+            return;
+        record->hash = positionHash(position);
+        record->move = mv;
+        publish();
+    }
+
+    /** A move taken back, from and to are the squares the piece went between to take it back. */
+    void takeback(int board,thc::ChessPosition& position,int from,int to) {
+        JournalRecord* record = claim(board,JOURNAL_TAKEBACK);
+        if(!record)
+            return;
+        record->hash = positionHash(position);
+        record->move.src = (thc::Square)from;
+        record->move.dst = (thc::Square)to;
+        record->move.special = thc::NOT_SPECIAL;
+        publish();
+    }
+
+    /** The board was given a new position, before is the one it replaced. */
+    void position(int board,thc::ChessPosition& before,const thc::ChessPosition& after) {
+        JournalRecord* record = claim(board,JOURNAL_POSITION);
+        if(!record)
+            return;
+        record->hash = positionHash(before);
+        after.Compress(record->position.position);
+        record->position.halfMoveClock = (uint16_t)after.half_move_clock;
+        record->position.fullMoveCount = (uint16_t)after.full_move_count;
+        publish();
+    }
+};
+
+#endif //CONTROLLER_JOURNAL_HPP
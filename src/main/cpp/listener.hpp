@@ -0,0 +1,304 @@
+//
+// Non blocking listening sockets that are serviced from the controller's idle loop, for
+// clients that don't come in through the ssobjects telnet server.
+//
+
+#ifndef CONTROLLER_LISTENER_HPP
+#define CONTROLLER_LISTENER_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+
+#include "connection.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+/** What a listener calls when something happens on one of its connections. */
+class CommandHandler {
+public:
+    virtual ~CommandHandler() {}
+    virtual void onConnect(Connection* conn)=0;
+    /** A complete command line, without the terminator. */
+    virtual void onLine(Connection* conn,char* line)=0;
+    /** Called before the connection is deleted. */
+    virtual void onDisconnect(Connection* conn)=0;
+};
+
+/**
+ * A client on a socket we own. Writes never block: whatever the socket won't take right away
+ * is kept and sent the next time the listener is polled. A client that falls too far behind
+ * is disconnected rather than letting its backlog grow without limit.
+ */
+class SocketConnection : public Connection {
+public:
+    enum {MAX_BACKLOG=1024*1024};
+
+    int fd;
+    string inbox;           ///< Received bytes not processed yet.
+    string outbox;          ///< Bytes the socket wouldn't take yet.
+    bool closing;           ///< Dropped at the next poll.
+    bool lingering;         ///< Closed once the backlog has been sent.
+    bool announced;         ///< The handler has been told about it with onConnect.
+
+    SocketConnection(int sock) : Connection(),fd(sock),closing(false),lingering(false),announced(false) {}
+    virtual ~SocketConnection() {
+        close(fd);
+    }
+
+    void write(const char* buffer,size_t n) {
+        if(closing)
+            return;
+        if(outbox.empty()) {
+            ssize_t sent = ::send(fd,buffer,n,MSG_DONTWAIT|MSG_NOSIGNAL);
+            if(sent < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    closing = true;
+                    return;
+                }
+                sent = 0;
+            }
+            buffer += sent;
+            n -= sent;
+        }
+        if(n) {
+            if(outbox.size()+n > MAX_BACKLOG) {
+                LOG_WARN("client fell too far behind, disconnecting");
+                closing = true;
+                return;
+            }
+            outbox.append(buffer,n);
+        }
+    }
+
+    /** Sends as much of the backlog as the socket will take. */
+    void flush() {
+        if(outbox.empty() || closing)
+            return;
+        ssize_t sent = ::send(fd,outbox.data(),outbox.size(),MSG_DONTWAIT|MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                closing = true;
+            return;
+        }
+        outbox.erase(0,sent);
+    }
+
+    size_t queued() {
+        return outbox.size();
+    }
+};
+
+/**
+ * Accepts connections on a non blocking socket and reads from them whenever poll() is
+ * called. Subclasses decide how the received bytes are framed.
+ */
+class Listener {
+protected:
+    int m_fd;
+    CommandHandler* m_handler;
+    vector<SocketConnection*> m_connections;
+
+    /** Creates the connection object for a newly accepted socket. */
+    virtual SocketConnection* newConnection(int fd) {
+        return new SocketConnection(fd);
+    }
+
+    /** Handles whatever complete messages are in conn->inbox, leaving any partial one. */
+    virtual void process(SocketConnection* conn)=0;
+
+    /** False if the connection has to do a handshake before the handler is told about it, see announce(). */
+    virtual bool announceOnAccept() {return true;}
+
+    /** Tells the handler about the connection, from then on it gets commands and events. */
+    void announce(SocketConnection* conn) {
+        conn->announced = true;
+        m_handler->onConnect(conn);
+    }
+
+    /** Binds a TCP socket on all interfaces. */
+    bool listenTcp(int port) {
+        int fd = socket(AF_INET,SOCK_STREAM,0);
+        if(fd < 0) {
+            perror("socket");
+            return false;
+        }
+        int on=1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        struct sockaddr_in sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        sa.sin_port = htons(port);
+        if(bind(fd,(struct sockaddr*)&sa,sizeof(sa)) < 0) {
+            perror("bind");
+            close(fd);
+            return false;
+        }
+        return startListening(fd);
+    }
+
+    /** Takes ownership of a bound socket and starts listening on it. */
+    bool startListening(int fd) {
+        if(::listen(fd,8) < 0 || fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK) < 0) {
+            perror("listen");
+            close(fd);
+            return false;
+        }
+        m_fd = fd;
+        return true;
+    }
+
+public:
+    Listener(CommandHandler* handler) : m_fd(-1),m_handler(handler) {}
+    virtual ~Listener() {
+        for(size_t i=0; i<m_connections.size(); i++) {
+            if(m_connections[i]->announced)
+                m_handler->onDisconnect(m_connections[i]);
+            delete m_connections[i];
+        }
+        if(m_fd >= 0)
+            close(m_fd);
+    }
+
+    bool listening() {return m_fd >= 0;}
+
+    /** Accepts new clients, reads and processes what they sent, and sends their backlogs. */
+    void poll() {
+        if(m_fd < 0)
+            return;
+        int fd;
+        while((fd = accept(m_fd,NULL,NULL)) >= 0) {
+            fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+            SocketConnection* conn = newConnection(fd);
+            m_connections.push_back(conn);
+            if(announceOnAccept())
+                announce(conn);
+        }
+        char buffer[4096];
+        for(size_t i=0; i<m_connections.size();) {
+            SocketConnection* conn = m_connections[i];
+            ssize_t n=-1;
+            while(!conn->closing && (n = recv(conn->fd,buffer,sizeof(buffer),MSG_DONTWAIT)) != 0) {
+                if(n < 0) {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK)
+                        conn->closing = true;
+                    break;
+                }
+                conn->inbox.append(buffer,n);
+                process(conn);
+            }
+            if(n == 0)
+                conn->closing = true;
+            conn->flush();
+            if(conn->lingering && conn->outbox.empty())
+                conn->closing = true;
+            if(conn->closing) {
+                if(conn->announced)
+                    m_handler->onDisconnect(conn);
+                delete conn;
+                m_connections.erase(m_connections.begin()+i);
+            } else {
+                i++;
+            }
+        }
+    }
+};
+
+/** Listens on a unix domain socket. Clients send the same json command lines as on the telnet port. */
+class UnixLineListener : public Listener {
+protected:
+    string m_path;
+
+    void process(SocketConnection* conn) {
+        size_t eol;
+        while(!conn->closing && (eol = conn->inbox.find('\n')) != string::npos) {
+            string line = conn->inbox.substr(0,eol);
+            conn->inbox.erase(0,eol+1);
+            if(!line.empty() && line[line.size()-1] == '\r')
+                line.erase(line.size()-1);
+            if(!line.empty())
+                m_handler->onLine(conn,&line[0]);
+        }
+    }
+
+public:
+    UnixLineListener(CommandHandler* handler) : Listener(handler) {}
+    ~UnixLineListener() {
+        if(listening())
+            unlink(m_path.c_str());
+    }
+
+    /** Binds to the path, replacing a socket left behind by an earlier run. */
+    bool listen(const char* path) {
+        struct sockaddr_un sa;
+        if(strlen(path) >= sizeof(sa.sun_path)) {
+            fprintf(stderr,"unix socket path too long: %s\n",path);
+            return false;
+        }
+        int fd = socket(AF_UNIX,SOCK_STREAM,0);
+        if(fd < 0) {
+            perror("socket");
+            return false;
+        }
+        memset(&sa,0,sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path,path);
+        unlink(path);
+        if(bind(fd,(struct sockaddr*)&sa,sizeof(sa)) < 0) {
+            perror("bind");
+            close(fd);
+            return false;
+        }
+        m_path = path;
+        return startListening(fd);
+    }
+
+    /**
+     * Passes a file descriptor to a client on this socket, along with a line of text.
+     * @return false if it couldn't be sent.
+     */
+    bool sendFd(SocketConnection* conn,int fdToSend,const string& text) {
+        conn->flush();
+        if(!conn->outbox.empty())
+            return false;   //would reorder the stream
+        string line = text+"\r\n";
+        struct iovec iov;
+        iov.iov_base = (void*)line.data();
+        iov.iov_len = line.size();
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control,0,sizeof(control));
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg),&fdToSend,sizeof(int));
+        return sendmsg(conn->fd,&msg,MSG_NOSIGNAL) == (ssize_t)line.size();
+    }
+
+    /** True if the connection came in on this listener. */
+    bool owns(Connection* conn) {
+        for(size_t i=0; i<m_connections.size(); i++) {
+            if(m_connections[i] == conn)
+                return true;
+        }
+        return false;
+    }
+};
+
+#endif //CONTROLLER_LISTENER_HPP
@@ -0,0 +1,165 @@
+//
+// Leveled logging that never blocks the caller on stdout.
+//
+
+#ifndef CONTROLLER_LOG_HPP
+#define CONTROLLER_LOG_HPP
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <thread>
+
+/**
+ * Logs a message if its level is enabled. The arguments are only evaluated and formatted when
+ * it is, so a disabled LOG_DEBUG costs a compare. Example:
+ * LOG_INFO("board %d put down piece on %s",id,square);
+ */
+#define LOG_AT(level,...) do { if(Logger::instance().enabled(level)) Logger::instance().write(level,__VA_ARGS__); } while(0)
+#define LOG_ERROR(...) LOG_AT(Logger::LEVEL_ERROR,__VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(Logger::LEVEL_WARN,__VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(Logger::LEVEL_INFO,__VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(Logger::LEVEL_DEBUG,__VA_ARGS__)
+
+/**
+ * Messages are formatted straight into a slot of a fixed ring and written to stdout by a
+ * background thread, so a slow terminal or journal can't stall the scan loop. Any thread can
+ * log: a slot is claimed with a compare and swap on the head, and handed to the writer thread
+ * by publishing its sequence number (a bounded queue in the style of Dmitry Vyukov's). When the
+ * ring is full the message is dropped and counted, and the count is logged once there's room.
+ *
+ * Each line is "<time> <LEVEL> <message>", the time in UTC with milliseconds.
+ */
+class Logger {
+public:
+    enum {LEVEL_ERROR,LEVEL_WARN,LEVEL_INFO,LEVEL_DEBUG};
+    enum {SLOTS=1024,MESSAGE_SIZE=240};
+
+protected:
+    struct Slot {
+        uint64_t seq;               ///< Position + 1 once the message is ready, position + SLOTS once it's been written.
+        uint64_t time;              ///< Microseconds since the epoch.
+        int level;
+        char message[MESSAGE_SIZE];
+    };
+
+    Slot m_slots[SLOTS];
+    uint64_t m_head;                ///< Next position to claim.
+    uint64_t m_tail;                ///< Next position the writer thread writes, only it touches this.
+    uint64_t m_dropped;
+    int m_level;
+    bool m_running;
+    std::thread m_thread;
+
+    Logger() : m_head(0),m_tail(0),m_dropped(0),m_level(LEVEL_INFO),m_running(true) {
+        for(uint64_t i=0; i<SLOTS; i++)
+            m_slots[i].seq = i;
+        m_thread = std::thread(&Logger::run,this);
+    }
+
+    /** Writes out whatever is ready, returns how many lines were written. */
+    int drain() {
+        int n=0;
+        for(;;) {
+            Slot& slot = m_slots[m_tail%SLOTS];
+            if(__atomic_load_n(&slot.seq,__ATOMIC_ACQUIRE) != m_tail+1)
+                break;
+            char stamp[32];
+            time_t seconds = slot.time/1000000;
+            struct tm tm;
+            gmtime_r(&seconds,&tm);
+            size_t len = strftime(stamp,sizeof(stamp),"%H:%M:%S",&tm);
+            snprintf(stamp+len,sizeof(stamp)-len,".%03u",(unsigned)(slot.time/1000%1000));
+            fprintf(stdout,"%s %s %s\n",stamp,levelName(slot.level),slot.message);
+            __atomic_store_n(&slot.seq,m_tail+SLOTS,__ATOMIC_RELEASE);
+            m_tail++;
+            n++;
+        }
+        uint64_t dropped = __atomic_exchange_n(&m_dropped,0,__ATOMIC_ACQ_REL);
+        if(dropped)
+            fprintf(stdout,"log ring full, dropped %llu messages\n",(unsigned long long)dropped);
+        if(n || dropped)
+            fflush(stdout);
+        return n;
+    }
+
+    void run() {
+        while(__atomic_load_n(&m_running,__ATOMIC_ACQUIRE)) {
+            if(!drain())
+                usleep(5000);
+        }
+        drain();
+    }
+
+public:
+    ~Logger() {
+        __atomic_store_n(&m_running,false,__ATOMIC_RELEASE);
+        m_thread.join();
+    }
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    static const char* levelName(int level) {
+        switch(level) {
+            case LEVEL_ERROR: return "ERROR";
+            case LEVEL_WARN: return "WARN ";
+            case LEVEL_INFO: return "INFO ";
+            case LEVEL_DEBUG: return "DEBUG";
+        }
+        return "?    ";
+    }
+
+    /** Level from a name like "debug", or -1 if there is no such level. */
+    static int levelFromName(const char* name) {
+        if(!strcmp(name,"error")) return LEVEL_ERROR;
+        if(!strcmp(name,"warn")) return LEVEL_WARN;
+        if(!strcmp(name,"info")) return LEVEL_INFO;
+        if(!strcmp(name,"debug")) return LEVEL_DEBUG;
+        return -1;
+    }
+
+    void setLevel(int level) {
+        __atomic_store_n(&m_level,level,__ATOMIC_RELAXED);
+    }
+
+    bool enabled(int level) {
+        return level <= __atomic_load_n(&m_level,__ATOMIC_RELAXED);
+    }
+
+    /** Formats the message into the ring. Use the LOG_ macros, they check the level first. */
+    __attribute__((format(printf,3,4))) void write(int level,const char* format,...) {
+        uint64_t pos = __atomic_load_n(&m_head,__ATOMIC_RELAXED);
+        Slot* slot;
+        for(;;) {
+            slot = &m_slots[pos%SLOTS];
+            int64_t diff = (int64_t)(__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE)-pos);
+            if(diff == 0) {
+                if(__atomic_compare_exchange_n(&m_head,&pos,pos+1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                    break;
+            } else if(diff < 0) {
+                __atomic_add_fetch(&m_dropped,1,__ATOMIC_RELAXED);
+                return;
+            } else {
+                pos = __atomic_load_n(&m_head,__ATOMIC_RELAXED);
+            }
+        }
+        struct timeval tv;
+        gettimeofday(&tv,NULL);
+        slot->time = (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+        slot->level = level;
+        va_list args;
+        va_start(args,format);
+        vsnprintf(slot->message,sizeof(slot->message),format,args);
+        va_end(args);
+        __atomic_store_n(&slot->seq,pos+1,__ATOMIC_RELEASE);
+    }
+};
+
+#endif //CONTROLLER_LOG_HPP
@@ -0,0 +1,203 @@
+//
+// Counters and latency histograms for the stats action and the Prometheus port.
+//
+
+#ifndef CONTROLLER_METRICS_HPP
+#define CONTROLLER_METRICS_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+
+#include "json.hpp"
+#include "listener.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+/** Microseconds from a clock that doesn't jump, for timing things. */
+inline uint64_t monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/**
+ * Latency histogram with power of two buckets in microseconds: bucket n counts the samples
+ * of at most 2^n us, the last bucket everything bigger. Adding a sample is a few additions,
+ * no allocation and no locking.
+ */
+class Histogram {
+public:
+    enum {BUCKETS=24};      ///< Last bounded bucket is 2^22us, about 4 seconds.
+
+    uint64_t buckets[BUCKETS];
+    uint64_t count;
+    uint64_t sum;           ///< Microseconds.
+    uint64_t max;
+
+    Histogram() {
+        reset();
+    }
+
+    void reset() {
+        memset(buckets,0,sizeof(buckets));
+        count = sum = max = 0;
+    }
+
+    void add(uint64_t us) {
+        int bucket=0;
+        while(bucket < BUCKETS-1 && us > (1ULL<<bucket))
+            bucket++;
+        buckets[bucket]++;
+        count++;
+        sum += us;
+        if(us > max)
+            max = us;
+    }
+
+    /** Adds the samples of another histogram to this one. */
+    void merge(const Histogram& other) {
+        for(int i=0; i<BUCKETS; i++)
+            buckets[i] += other.buckets[i];
+        count += other.count;
+        sum += other.sum;
+        if(other.max > max)
+            max = other.max;
+    }
+
+    /** Smallest bucket bound that holds at least fraction of the samples, 0 if there are none. */
+    uint64_t percentile(double fraction) {
+        uint64_t want = (uint64_t)(count*fraction+0.5);
+        uint64_t seen=0;
+        for(int i=0; i<BUCKETS; i++) {
+            seen += buckets[i];
+            if(seen >= want && seen)
+                return i < BUCKETS-1 ? (1ULL<<i) : max;
+        }
+        return 0;
+    }
+
+    /** {"count":N,"mean":us,"p50":us,"p99":us,"max":us} */
+    json tojson() {
+        json j;
+        j["count"] = count;
+        j["mean"] = count ? sum/count : 0;
+        j["p50"] = percentile(0.5);
+        j["p99"] = percentile(0.99);
+        j["max"] = max;
+        return j;
+    }
+
+    /**
+     * Appends the histogram in the Prometheus text format, in seconds.
+     * @param labels Extra labels like board="0", or "" for none.
+     */
+    void prometheus(string& out,const char* name,const char* labels) {
+        char buffer[256];
+        const char* sep = *labels ? "," : "";
+        uint64_t cumulative=0;
+        for(int i=0; i<BUCKETS-1; i++) {
+            cumulative += buckets[i];
+            snprintf(buffer,sizeof(buffer),"%s_bucket{%s%sle=\"%g\"} %llu\n",name,labels,sep,(double)(1ULL<<i)/1e6,(unsigned long long)cumulative);
+            out += buffer;
+        }
+        snprintf(buffer,sizeof(buffer),"%s_bucket{%s%sle=\"+Inf\"} %llu\n",name,labels,sep,(unsigned long long)count);
+        out += buffer;
+        snprintf(buffer,sizeof(buffer),"%s_sum{%s} %g\n%s_count{%s} %llu\n",name,labels,(double)sum/1e6,name,labels,(unsigned long long)count);
+        out += buffer;
+    }
+};
+
+/**
+ * What the controller measures about itself. Everything is updated from the event loop, the
+ * one thread that scans the boards and talks to clients, so plain fields are enough and
+ * recording a measurement never waits on anything.
+ */
+class Metrics {
+public:
+    uint64_t started;               ///< monotonicMicros() at startup.
+    uint64_t events;                ///< Events broadcast.
+    uint64_t commands;              ///< Commands dispatched.
+    uint64_t commandErrors;         ///< Commands that didn't succeed.
+    double eventsPerSec;            ///< Over the last full second.
+    Histogram broadcastTime;        ///< Rendering excluded, queueing the event to every client.
+    map<string,Histogram> commandTime;  ///< By action.
+
+protected:
+    uint64_t m_rateStart;
+    uint64_t m_rateEvents;
+
+public:
+    Metrics() : events(0),commands(0),commandErrors(0),eventsPerSec(0) {
+        started = m_rateStart = monotonicMicros();
+        m_rateEvents = 0;
+    }
+
+    void commandDone(const string& action,bool success,uint64_t us) {
+        commands++;
+        if(!success)
+            commandErrors++;
+        commandTime[action].add(us);
+    }
+
+    /** Updates the rates, call it every idle. */
+    void tick() {
+        uint64_t now = monotonicMicros();
+        if(now-m_rateStart < 1000000)
+            return;
+        eventsPerSec = (double)(events-m_rateEvents)*1e6/(now-m_rateStart);
+        m_rateStart = now;
+        m_rateEvents = events;
+    }
+
+    double uptime() {
+        return (double)(monotonicMicros()-started)/1e6;
+    }
+};
+
+/** Renders the Prometheus text for the metrics port. */
+class MetricsSource {
+public:
+    virtual ~MetricsSource() {}
+    virtual string prometheusText()=0;
+};
+
+/**
+ * Minimal HTTP server for Prometheus to scrape. Whatever is asked for, the answer is the
+ * current metrics, and the connection is closed once they are sent.
+ */
+class MetricsListener : public Listener {
+protected:
+    MetricsSource* m_source;
+
+    bool announceOnAccept() {return false;}
+
+    void process(SocketConnection* conn) {
+        if(conn->lingering || conn->inbox.find("\r\n\r\n") == string::npos) {
+            if(conn->inbox.size() > 8192)
+                conn->closing = true;
+            return;
+        }
+        string body = m_source->prometheusText();
+        char header[160];
+        int n = snprintf(header,sizeof(header),
+                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                         (unsigned)body.size());
+        conn->write(header,n);
+        conn->write(body.c_str(),body.size());
+        conn->lingering = true;
+    }
+
+public:
+    MetricsListener(CommandHandler* handler,MetricsSource* source) : Listener(handler),m_source(source) {}
+
+    bool listen(int port) {
+        return listenTcp(port);
+    }
+};
+
+#endif //CONTROLLER_METRICS_HPP
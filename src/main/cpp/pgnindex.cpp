@@ -0,0 +1,327 @@
+//
+// Builds the opening explorer table the controller's explorer action answers from, out of PGN
+// files. Every game is played through with thc, and each move counted against the position it
+// was played from, with the game's result. The files are split between threads, one per core
+// by default.
+//
+//g++ -o chesslrindex -std=c++11 -O2 -I src/main/cpp src/main/cpp/pgnindex.cpp src/main/cpp/thc.cpp -lpthread
+//
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "thc.h"
+#include "binaryprotocol.hpp"
+#include "positionhash.hpp"
+#include "explorer.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+enum {RESULT_NONE,RESULT_WHITE,RESULT_DRAW,RESULT_BLACK};
+
+/** A run of whole games in a mapped PGN file. */
+struct Chunk {
+    const char* begin;
+    const char* end;
+};
+
+struct KeyHash {
+    size_t operator()(const pair<uint64_t,uint16_t>& key) const {
+        return (size_t)(key.first ^ (uint64_t)key.second*0x9e3779b97f4a7c15ULL);
+    }
+};
+
+/** What one thread has counted. */
+struct Tally {
+    unordered_map<pair<uint64_t,uint16_t>,ExplorerEntry,KeyHash> moves;
+    uint64_t games;
+    uint64_t errors;            ///< Games with a move that didn't parse, counted up to that move.
+
+    Tally() : games(0),errors(0) {}
+};
+
+int resultFrom(const string& text) {
+    if(text == "1-0") return RESULT_WHITE;
+    if(text == "0-1") return RESULT_BLACK;
+    if(text == "1/2-1/2") return RESULT_DRAW;
+    return RESULT_NONE;
+}
+
+/** The start of the next line at or after p. */
+const char* nextLine(const char* p,const char* end) {
+    const char* nl = (const char*)memchr(p,'\n',end-p);
+    return nl ? nl+1 : end;
+}
+
+/**
+ * Where the first game at or after p starts: a tag line that comes after a line that isn't one,
+ * so the split never lands between a game's tags and its moves.
+ */
+const char* gameStart(const char* p,const char* start,const char* end) {
+    if(p == start)
+        return p;
+    p = nextLine(p-1,end);
+    bool afterMoves=false;
+    for(; p<end; p=nextLine(p,end)) {
+        if(*p == '[') {
+            if(afterMoves)
+                return p;
+        } else if(*p != '\r' && *p != '\n') {
+            afterMoves = true;
+        }
+    }
+    return end;
+}
+
+/** The value of a tag line like [Result "1-0"], if it's the named tag. */
+bool tagValue(const char* line,const char* end,const char* name,string& value) {
+    size_t n = strlen(name);
+    if(end-line < (ptrdiff_t)n+2 || strncmp(line+1,name,n) || line[n+1] != ' ')
+        return false;
+    const char* open = (const char*)memchr(line,'"',end-line);
+    const char* close = open ? (const char*)memchr(open+1,'"',end-open-1) : NULL;
+    if(!close)
+        return false;
+    value.assign(open+1,close);
+    return true;
+}
+
+/** Plays through a game's moves, counting the first maxPly of them. */
+void countGame(Tally& tally,const string& fen,int result,const string& moves,int maxPly) {
+    thc::ChessRules rules;
+    if(!fen.empty() && !rules.Forsyth(fen.c_str())) {
+        tally.errors++;
+        return;
+    }
+    tally.games++;
+    const char* p = moves.c_str();
+    int depth=0;
+    for(int ply=0; ply<maxPly && *p;) {
+        char c = *p;
+        if(c == '{') {
+            const char* close = strchr(p,'}');
+            p = close ? close+1 : p+strlen(p);
+        } else if(c == ';') {
+            const char* nl = strchr(p,'\n');
+            p = nl ? nl : p+strlen(p);
+        } else if(c == '(') {
+            depth++;
+            p++;
+        } else if(c == ')') {
+            depth--;
+            p++;
+        } else if(isspace((unsigned char)c) || depth > 0) {
+            p++;
+        } else {
+            const char* start = p;
+            while(*p && !isspace((unsigned char)*p) && !strchr("{}();",*p))
+                p++;
+            string token(start,p);
+            if(token[0] == '$' || token == "*" || resultFrom(token) != RESULT_NONE)
+                continue;
+            size_t skip = 0;
+            while(skip < token.size() && (isdigit((unsigned char)token[skip]) || token[skip] == '.'))
+                skip++;
+            token.erase(0,skip);
+            while(!token.empty() && strchr("!?+#",token[token.size()-1]))
+                token.erase(token.size()-1);
+            if(token.empty())
+                continue;
+            if(token == "0-0")
+                token = "O-O";
+            else if(token == "0-0-0")
+                token = "O-O-O";
+            thc::Move mv;
+            if(!mv.NaturalIn(&rules,token.c_str())) {
+                tally.errors++;
+                return;
+            }
+            uint64_t hash = positionHash(rules);
+            ExplorerEntry& entry = tally.moves[make_pair(hash,packMove(mv))];
+            if(!entry.count) {
+                entry.hash = hash;
+                entry.move = packMove(mv);
+            }
+            entry.count++;
+            entry.white += result == RESULT_WHITE;
+            entry.draws += result == RESULT_DRAW;
+            entry.black += result == RESULT_BLACK;
+            rules.PlayMove(mv);
+            ply++;
+        }
+    }
+}
+
+/** Counts the games of a chunk. */
+void countChunk(Tally& tally,const Chunk& chunk,int maxPly) {
+    string fen,result,moves,value;
+    bool inMoves=false;
+    for(const char* line=chunk.begin; line<chunk.end;) {
+        const char* next = nextLine(line,chunk.end);
+        if(*line == '[') {
+            if(inMoves) {
+                countGame(tally,fen,resultFrom(result),moves,maxPly);
+                fen.clear();
+                result.clear();
+                moves.clear();
+                inMoves = false;
+            }
+            if(tagValue(line,next,"FEN",value))
+                fen = value;
+            else if(tagValue(line,next,"Result",value))
+                result = value;
+        } else if(*line != '\r' && *line != '\n') {
+            inMoves = true;
+            moves.append(line,next);
+        }
+        line = next;
+    }
+    if(inMoves)
+        countGame(tally,fen,resultFrom(result),moves,maxPly);
+}
+
+void usage() {
+    printf("usage: chesslrindex [-j threads] [--max-ply n] [--min-count n] -o table file.pgn...\n"
+           "  -o table         where to write the explorer table, for the controller's --explorer\n"
+           "  -j threads       how many threads to count with, default one per core\n"
+           "  --max-ply n      count the first n half moves of each game, default 40\n"
+           "  --min-count n    leave out moves played in fewer than n games, default 1\n");
+}
+
+int main(int argc,char* argv[]) {
+    const char* outPath = NULL;
+    int threadCount = std::thread::hardware_concurrency();
+    int maxPly = 40;
+    unsigned minCount = 1;
+    vector<const char*> inputs;
+    for(int i=1; i<argc; i++) {
+        if(!strcmp(argv[i],"-o") && i+1<argc) {
+            outPath = argv[++i];
+        } else if(!strcmp(argv[i],"-j") && i+1<argc) {
+            threadCount = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--max-ply") && i+1<argc) {
+            maxPly = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"--min-count") && i+1<argc) {
+            minCount = atoi(argv[++i]);
+        } else if(argv[i][0] == '-') {
+            usage();
+            return 1;
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if(!outPath || inputs.empty()) {
+        usage();
+        return 1;
+    }
+    if(threadCount < 1)
+        threadCount = 1;
+    uint64_t started = monotonicMicros();
+
+    //map the files and cut them into chunks of whole games, several per thread so they even out
+    vector<Chunk> chunks;
+    for(auto path : inputs) {
+        int fd = open(path,O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd,&st) < 0) {
+            perror(path);
+            return 1;
+        }
+        if(!st.st_size) {
+            close(fd);
+            continue;
+        }
+        void* p = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd);
+        if(p == MAP_FAILED) {
+            perror(path);
+            return 1;
+        }
+        madvise(p,st.st_size,MADV_SEQUENTIAL);
+        const char* start = (const char*)p;
+        const char* end = start+st.st_size;
+        size_t pieces = threadCount*4;
+        const char* from = start;
+        for(size_t i=1; i<=pieces; i++) {
+            const char* to = i == pieces ? end : gameStart(start+st.st_size*i/pieces,start,end);
+            if(to > from) {
+                Chunk chunk = {from,to};
+                chunks.push_back(chunk);
+                from = to;
+            }
+        }
+    }
+
+    vector<Tally> tallies(threadCount);
+    vector<std::thread> threads;
+    size_t nextChunk=0;
+    for(int t=0; t<threadCount; t++) {
+        threads.push_back(std::thread([&,t]() {
+            for(;;) {
+                size_t i = __atomic_fetch_add(&nextChunk,1,__ATOMIC_RELAXED);
+                if(i >= chunks.size())
+                    break;
+                countChunk(tallies[t],chunks[i],maxPly);
+            }
+        }));
+    }
+    for(auto& thread : threads)
+        thread.join();
+
+    //merge what the threads counted, sorted the way the table is searched
+    uint64_t games=0,errors=0;
+    vector<ExplorerEntry> entries;
+    for(auto& tally : tallies) {
+        games += tally.games;
+        errors += tally.errors;
+        for(auto& it : tally.moves)
+            entries.push_back(it.second);
+        tally.moves.clear();
+    }
+    std::sort(entries.begin(),entries.end());
+    size_t kept=0;
+    for(size_t i=0; i<entries.size();) {
+        ExplorerEntry entry = entries[i++];
+        while(i < entries.size() && entries[i].hash == entry.hash && entries[i].move == entry.move)
+            entry.add(entries[i++]);
+        if(entry.count >= minCount)
+            entries[kept++] = entry;
+    }
+    entries.resize(kept);
+
+    string tmp = string(outPath)+".tmp";
+    FILE* file = fopen(tmp.c_str(),"wb");
+    if(!file) {
+        perror(tmp.c_str());
+        return 1;
+    }
+    ExplorerHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,EXPLORER_MAGIC,4);
+    header.version = EXPLORER_VERSION;
+    header.games = games;
+    header.entries = entries.size();
+    bool ok = fwrite(&header,sizeof(header),1,file) == 1
+              && fwrite(entries.data(),sizeof(ExplorerEntry),entries.size(),file) == entries.size();
+    ok = fclose(file) == 0 && ok;
+    if(!ok || rename(tmp.c_str(),outPath) < 0) {
+        perror(outPath);
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("%llu games, %llu with moves that didn't parse, %u moves from positions, %.1f s on %d threads\n",
+           (unsigned long long)games,(unsigned long long)errors,(unsigned)entries.size(),(monotonicMicros()-started)/1e6,threadCount);
+    return 0;
+}
@@ -0,0 +1,35 @@
+//
+// A 64 bit key for a chess position, the same for the same position however it was reached.
+//
+
+#ifndef CONTROLLER_POSITIONHASH_HPP
+#define CONTROLLER_POSITIONHASH_HPP
+
+#include <stdint.h>
+
+#include "thc.h"
+
+/**
+ * thc's Zobrist hash of the pieces, with whose turn it is, the castling rights and the en
+ * passant square mixed in, so positions that only differ in those don't share a key. En passant
+ * only counts when a capture is possible, like in repetitions.
+ */
+inline uint64_t positionHash(thc::ChessPosition& position) {
+    uint64_t hash = position.Hash64Calculate();
+    if(!position.white)
+        hash = ~hash;
+    if(position.wking_allowed())
+        hash ^= 0x3a8f05c5d6e2b1a7ULL;
+    if(position.wqueen_allowed())
+        hash ^= 0x8c1e6f2b94d7035eULL;
+    if(position.bking_allowed())
+        hash ^= 0x5b72d9e04a1f86c3ULL;
+    if(position.bqueen_allowed())
+        hash ^= 0xe4096b3c7d25fa18ULL;
+    thc::Square ep = position.groomed_enpassant_target();
+    if(ep != thc::SQUARE_INVALID)
+        hash ^= 0x9e3779b97f4a7c15ULL*(uint64_t)(ep+1);
+    return hash;
+}
+
+#endif //CONTROLLER_POSITIONHASH_HPP
@@ -0,0 +1,163 @@
+//
+// Shared memory view of the board for local readers, so they can follow events
+// without a system call per event.
+//
+
+#ifndef CONTROLLER_SHMRING_HPP
+#define CONTROLLER_SHMRING_HPP
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <string>
+
+using namespace std;
+
+#define SHM_MAGIC 0x534c5243   ///< "CRLS" in memory, identifies the region
+#define SHM_VERSION 2
+#define SHM_MAX_BOARDS 8  ///< Boards past this one aren't in the region, their events still are.
+
+/**
+ * One event, as the binary frame a binary client would get (see binaryprotocol.hpp).
+ *
+ * The writer sets seq to 0, fills in the frame, then sets seq to the event's sequence number.
+ * A reader that wants event n loads seq, copies the frame, then loads seq again; if either
+ * load isn't n the writer has lapped the reader and it has to resync from the header.
+ */
+struct ShmSlot {
+    uint64_t seq;
+    uint32_t length;
+    uint32_t reserved;
+    unsigned char frame[48];
+};
+
+/** One board's bitboards in the header, updated on every pass of the server loop. */
+struct ShmBoardState {
+    uint64_t occupancy;         ///< Occupancy the board has taken in, see Board::occupancy().
+    uint64_t leds;
+    uint64_t flash;
+};
+
+/**
+ * Start of the shared region, followed by slotCount ShmSlots. Every field is read with an
+ * acquire load (__atomic_load_n(&field,__ATOMIC_ACQUIRE) in C).
+ *
+ * stateVersion is a seqlock over the board states: it is odd while they are being
+ * updated, so a reader copies them between two even, equal loads of stateVersion.
+ *
+ * futex is bumped after every event and state change. A reader that has caught up and wants
+ * to sleep increments waiters, checks head again, FUTEX_WAITs on futex, then decrements
+ * waiters. The writer only makes the FUTEX_WAKE system call when waiters isn't 0.
+ */
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    uint64_t head;              ///< Sequence number of the newest event, its slot is head % slotCount.
+    uint32_t futex;
+    uint32_t waiters;
+    uint32_t stateVersion;
+    uint32_t boardCount;        ///< How many of the boards entries are in use.
+    ShmBoardState boards[SHM_MAX_BOARDS];
+};
+
+/** Writer side of the shared region. The region lives in a memfd that is handed to local clients. */
+class ShmRing {
+public:
+    enum {SLOT_COUNT=1024};
+
+protected:
+    int m_fd;
+    size_t m_size;
+    ShmHeader* m_header;
+    ShmSlot* m_slots;
+
+    void wake() {
+        __atomic_add_fetch(&m_header->futex,1,__ATOMIC_RELEASE);
+        if(__atomic_load_n(&m_header->waiters,__ATOMIC_ACQUIRE))
+            syscall(SYS_futex,&m_header->futex,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+    }
+
+public:
+    ShmRing() : m_fd(-1),m_size(0),m_header(NULL),m_slots(NULL) {}
+    ~ShmRing() {
+        if(m_header)
+            munmap(m_header,m_size);
+        if(m_fd >= 0)
+            close(m_fd);
+    }
+
+    /** The memfd, to pass to readers. */
+    int fd() {return m_fd;}
+    size_t size() {return m_size;}
+    bool created() {return m_header != NULL;}
+
+    /** Creates and maps the region. Its size is sealed so a reader's mapping can't be pulled out from under it. */
+    bool create() {
+        m_size = sizeof(ShmHeader)+SLOT_COUNT*sizeof(ShmSlot);
+        m_fd = memfd_create("chesslrcontroller",MFD_CLOEXEC|MFD_ALLOW_SEALING);
+        if(m_fd < 0) {
+            perror("memfd_create");
+            return false;
+        }
+        if(ftruncate(m_fd,m_size) < 0) {
+            perror("ftruncate");
+            return false;
+        }
+        fcntl(m_fd,F_ADD_SEALS,F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+        void* p = mmap(NULL,m_size,PROT_READ|PROT_WRITE,MAP_SHARED,m_fd,0);
+        if(p == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        m_header = (ShmHeader*)p;
+        m_slots = (ShmSlot*)(m_header+1);
+        m_header->slotCount = SLOT_COUNT;
+        m_header->slotSize = sizeof(ShmSlot);
+        m_header->version = SHM_VERSION;
+        __atomic_store_n(&m_header->magic,SHM_MAGIC,__ATOMIC_RELEASE);
+        return true;
+    }
+
+    /** Publishes an event. Frames too big for a slot aren't published, but still use up their sequence number. */
+    void publish(unsigned long seq,const string& frame) {
+        ShmSlot* slot = &m_slots[seq%SLOT_COUNT];
+        __atomic_store_n(&slot->seq,0,__ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if(frame.size() <= sizeof(slot->frame)) {
+            memcpy(slot->frame,frame.data(),frame.size());
+            slot->length = frame.size();
+        } else {
+            slot->length = 0;
+        }
+        __atomic_store_n(&slot->seq,(uint64_t)seq,__ATOMIC_RELEASE);
+        __atomic_store_n(&m_header->head,(uint64_t)seq,__ATOMIC_RELEASE);
+        wake();
+    }
+
+    /** Updates the state of a board, only touching the region if something changed. */
+    void setState(int board,uint64_t occupancy,uint64_t leds,uint64_t flash) {
+        if(board < 0 || board >= SHM_MAX_BOARDS)
+            return;
+        ShmBoardState* state = &m_header->boards[board];
+        if(board < (int)m_header->boardCount && occupancy == state->occupancy && leds == state->leds && flash == state->flash)
+            return;
+        __atomic_add_fetch(&m_header->stateVersion,1,__ATOMIC_ACQ_REL);
+        state->occupancy = occupancy;
+        state->leds = leds;
+        state->flash = flash;
+        if(board >= (int)m_header->boardCount)
+            m_header->boardCount = board+1;
+        __atomic_add_fetch(&m_header->stateVersion,1,__ATOMIC_RELEASE);
+        wake();
+    }
+};
+
+#endif //CONTROLLER_SHMRING_HPP
@@ -0,0 +1,199 @@
+//
+// Load client for a controller running simulated boards, see --simulate. Opens a number of
+// connections, switches them to binary frames, and measures the time from a square changing
+// on a board to the event reaching the client.
+//
+//g++ -o chesslrsim -std=c++11 -I src/main/cpp src/main/cpp/simclient.cpp -lpthread
+//
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#include "binaryprotocol.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+/** One connection to the controller. */
+struct SimClient {
+    int fd;
+    string inbox;
+    bool binary;            ///< The hello has been answered, everything from here on is frames.
+    uint64_t lastSeq;       ///< Highest event sequence number this client has seen.
+    uint64_t gaps;          ///< Events this client skipped over.
+};
+
+int connectTo(const char* host,const char* port) {
+    struct addrinfo hints,*res;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host,port,&hints,&res);
+    if(err) {
+        fprintf(stderr,"%s: %s\n",host,gai_strerror(err));
+        return -1;
+    }
+    int fd = socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+    if(fd >= 0 && connect(fd,res->ai_addr,res->ai_addrlen) < 0) {
+        perror("connect");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd >= 0) {
+        int on=1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+    }
+    return fd;
+}
+
+/**
+ * Takes the complete frames out of the client's inbox, adding each event's latency. events
+ * counts the events no client had seen before, newest is the highest seq any client has seen.
+ */
+void readFrames(SimClient& client,Histogram& latency,uint64_t& events,uint64_t& newest) {
+    if(!client.binary) {
+        //the welcome, any events sent before the hello, then the hello's reply, all json lines
+        size_t eol;
+        while(!client.binary && (eol = client.inbox.find("\r\n")) != string::npos) {
+            if(client.inbox.substr(0,eol).find("\"protocol\"") != string::npos)
+                client.binary = true;
+            client.inbox.erase(0,eol+2);
+        }
+        if(!client.binary)
+            return;
+    }
+    uint64_t now = frameTime();
+    size_t pos=0;
+    const unsigned char* p = (const unsigned char*)client.inbox.data();
+    while(client.inbox.size()-pos >= 2) {
+        size_t length = p[pos] | p[pos+1]<<8;
+        if(client.inbox.size()-pos-2 < length)
+            break;
+        const unsigned char* frame = p+pos+2;
+        int opcode = frame[0];
+        if(opcode >= OP_PIECE_UP && opcode <= OP_SETPOSITION && length >= 17) {
+            uint64_t seq=0,time=0;
+            for(int i=7; i>=0; i--) {
+                seq = seq<<8 | frame[1+i];
+                time = time<<8 | frame[9+i];
+            }
+            latency.add(now > time ? now-time : 0);
+            if(client.lastSeq && seq > client.lastSeq+1)
+                client.gaps += seq-client.lastSeq-1;
+            if(seq > client.lastSeq)
+                client.lastSeq = seq;
+            if(seq > newest) {
+                events++;
+                newest = seq;
+            }
+        }
+        pos += 2+length;
+    }
+    client.inbox.erase(0,pos);
+}
+
+void usage() {
+    printf("usage: chesslrsim [-h host] [-p port] [-c clients] [-t seconds]\n"
+           "Start the controller with --simulate <pgn> first, for example:\n"
+           "  chesslrcontroller --simulate games.pgn --sim-boards 64 --sim-speed 50\n");
+}
+
+int main(int argc,char* argv[]) {
+    const char* host = "localhost";
+    const char* port = "9999";
+    int clientCount = 1;
+    int seconds = 10;
+    for(int i=1; i<argc; i++) {
+        if(!strcmp(argv[i],"-h") && i+1<argc) {
+            host = argv[++i];
+        } else if(!strcmp(argv[i],"-p") && i+1<argc) {
+            port = argv[++i];
+        } else if(!strcmp(argv[i],"-c") && i+1<argc) {
+            clientCount = atoi(argv[++i]);
+        } else if(!strcmp(argv[i],"-t") && i+1<argc) {
+            seconds = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    vector<SimClient> clients;
+    const char* hello = "{\"action\":\"hello\",\"protocol\":\"binary\"}\r\n";
+    for(int i=0; i<clientCount; i++) {
+        SimClient client;
+        client.fd = connectTo(host,port);
+        if(client.fd < 0)
+            return 1;
+        client.binary = false;
+        client.lastSeq = 0;
+        client.gaps = 0;
+        if(send(client.fd,hello,strlen(hello),MSG_NOSIGNAL) < 0) {
+            perror("send");
+            return 1;
+        }
+        clients.push_back(client);
+    }
+    printf("%d clients connected to %s:%s\n",clientCount,host,port);
+
+    vector<struct pollfd> fds(clients.size());
+    for(size_t i=0; i<clients.size(); i++) {
+        fds[i].fd = clients[i].fd;
+        fds[i].events = POLLIN;
+    }
+    Histogram latency,total;
+    uint64_t events=0,newest=0,frames=0;
+    uint64_t start = monotonicMicros();
+    uint64_t report = start+1000000;
+    char buffer[65536];
+    while(monotonicMicros()-start < (uint64_t)seconds*1000000) {
+        if(poll(&fds[0],fds.size(),100) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        for(size_t i=0; i<clients.size(); i++) {
+            if(!(fds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+                continue;
+            ssize_t n = recv(clients[i].fd,buffer,sizeof(buffer),MSG_DONTWAIT);
+            if(n <= 0) {
+                if(n < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                fprintf(stderr,"controller closed the connection\n");
+                return 1;
+            }
+            clients[i].inbox.append(buffer,n);
+            uint64_t before = latency.count;
+            readFrames(clients[i],latency,events,newest);
+            frames += latency.count-before;
+        }
+        uint64_t now = monotonicMicros();
+        if(now >= report) {
+            printf("%6llu events/s  %7llu frames/s  latency us: p50 %llu  p99 %llu  max %llu\n",
+                   (unsigned long long)events,(unsigned long long)frames,
+                   (unsigned long long)latency.percentile(0.5),(unsigned long long)latency.percentile(0.99),(unsigned long long)latency.max);
+            total.merge(latency);
+            latency.reset();
+            events = frames = 0;
+            report += 1000000;
+        }
+    }
+    uint64_t gaps=0;
+    for(auto& client : clients)
+        gaps += client.gaps;
+    printf("total: %llu frames, latency us: mean %llu  p50 %llu  p99 %llu  max %llu, %llu events missed\n",
+           (unsigned long long)total.count,(unsigned long long)(total.count ? total.sum/total.count : 0),
+           (unsigned long long)total.percentile(0.5),(unsigned long long)total.percentile(0.99),
+           (unsigned long long)total.max,(unsigned long long)gaps);
+    return 0;
+}
@@ -0,0 +1,266 @@
+//
+// Virtual boards that play scripted games, for load testing without the hardware.
+//
+
+#ifndef CONTROLLER_SIMULATOR_HPP
+#define CONTROLLER_SIMULATOR_HPP
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "thc.h"
+#include "boardio.hpp"
+#include "binaryprotocol.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+typedef vector<thc::Move> SimGame;
+
+/**
+ * Reads the games from a PGN file, or a plain list of moves in SAN ("e4 e5 Nf3") or long
+ * algebraic ("e2e4 e7e5"). Tags, comments, variations, move numbers and NAGs are skipped and a
+ * result ends a game. A game stops at its first move that isn't legal, and before a promotion,
+ * since a board can't tell which piece the pawn was swapped for.
+ *
+ * @return false if the file can't be read or holds no moves.
+ */
+inline bool loadSimGames(const char* path,vector<SimGame>& games) {
+    FILE* file = fopen(path,"r");
+    if(!file) {
+        perror(path);
+        return false;
+    }
+    string text;
+    char buffer[4096];
+    size_t n;
+    while((n = fread(buffer,1,sizeof(buffer),file)) > 0)
+        text.append(buffer,n);
+    fclose(file);
+
+    thc::ChessRules cr;
+    SimGame game;
+    bool stopped=false;     //rest of the game is skipped
+    int depth=0;            //inside a variation
+    size_t i=0;
+    while(i < text.size()) {
+        char c = text[i];
+        if(c == '[') {
+            while(i < text.size() && text[i] != ']') i++;
+            i++;
+            continue;
+        } else if(c == '{') {
+            while(i < text.size() && text[i] != '}') i++;
+            i++;
+            continue;
+        } else if(c == ';') {
+            while(i < text.size() && text[i] != '\n') i++;
+            continue;
+        } else if(c == '(') {
+            depth++; i++;
+            continue;
+        } else if(c == ')') {
+            if(depth) depth--;
+            i++;
+            continue;
+        } else if(isspace((unsigned char)c)) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while(i < text.size() && !isspace((unsigned char)text[i]) && !strchr("{}();[",text[i])) i++;
+        string token = text.substr(start,i-start);
+        if(depth || token[0] == '$')
+            continue;
+        if(token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*") {
+            if(!game.empty())
+                games.push_back(game);
+            game.clear();
+            cr.Init();
+            stopped = false;
+            continue;
+        }
+        size_t dot = token.find_last_of('.');
+        if(dot != string::npos)
+            token = token.substr(dot+1);    //"12.e4" or "12..."
+        if(token.empty() || stopped)
+            continue;
+        thc::Move mv;
+        if(!mv.NaturalIn(&cr,token.c_str()) && !mv.TerseIn(&cr,token.c_str())) {
+            LOG_WARN("%s: %s isn't a legal move, skipping the rest of the game",path,token.c_str());
+            stopped = true;
+            continue;
+        }
+        if(mv.special >= thc::SPECIAL_PROMOTION_QUEEN && mv.special <= thc::SPECIAL_PROMOTION_KNIGHT) {
+            LOG_INFO("%s: stopping a game at the promotion %s",path,token.c_str());
+            stopped = true;
+            continue;
+        }
+        game.push_back(mv);
+        cr.PlayMove(mv);
+    }
+    if(!game.empty())
+        games.push_back(game);
+    if(games.empty()) {
+        fprintf(stderr,"%s has no moves\n",path);
+        return false;
+    }
+    return true;
+}
+
+/** How the virtual players behave. Times are in microseconds of simulated time. */
+struct SimParams {
+    double speed;           ///< Simulated time runs this many times faster than real time.
+    unsigned think;         ///< Between one move's last step and the next move's first.
+    unsigned hand;          ///< Between the steps of a move, like lifting a piece and putting it down.
+    unsigned jitter;        ///< Up to this much is added to or taken off each gap, at random.
+    unsigned bounce;        ///< How long a reed switch chatters when a piece is put down, 0 for clean contacts.
+    unsigned scanWindow;    ///< Changes closer together than this are seen by the same scan.
+
+    SimParams() : speed(1),think(400000),hand(250000),jitter(100000),bounce(0),scanWindow(10000) {}
+};
+
+/**
+ * A board that plays a scripted game, then sets the pieces up and plays it again. Every move is
+ * turned into the lifts and drops a player would make: a capture lifts the moving piece, then
+ * the captured piece, then drops the moving piece; castling moves the king, then the rook; en
+ * passant moves the pawn, then takes the captured pawn off. Gaps get random jitter, and a drop
+ * can bounce (down, up, down) for a few milliseconds.
+ *
+ * Each scan sees the next change that is due, and the changes that follow it within the scan
+ * window, so a short bounce is usually missed and a long one is seen. When the board falls
+ * behind it catches up a scan at a time (see backlog()), and changedAt() reports when the
+ * change was due, so event timestamps measure the whole delay.
+ */
+class SimulatedIO : public BoardIO {
+protected:
+    struct Step {
+        uint64_t time;      ///< Simulated microseconds since the game started.
+        int square;
+    };
+
+    const SimGame* m_game;
+    SimParams* m_params;
+    unsigned m_seed;
+    vector<Step> m_steps;   ///< Each step flips the square.
+    size_t m_next;
+    uint64_t m_end;         ///< When the game is over and the pieces go back.
+    uint64_t m_occupancy;
+    uint64_t m_changedAt;
+    uint64_t m_start;       ///< monotonicMicros() when the game started.
+    uint64_t m_startEpoch;  ///< frameTime() when the game started.
+
+    unsigned gap(unsigned base) {
+        if(!m_params->jitter)
+            return base;
+        int offset = (int)(rand_r(&m_seed)%(2*m_params->jitter+1))-(int)m_params->jitter;
+        int value = (int)base+offset;
+        int minimum = 2*m_params->scanWindow;
+        return value < minimum ? minimum : value;
+    }
+
+    void flip(uint64_t& t,int square,unsigned wait) {
+        t += gap(wait);
+        Step step = {t,square};
+        m_steps.push_back(step);
+    }
+
+    void drop(uint64_t& t,int square,unsigned wait) {
+        flip(t,square,wait);
+        if(m_params->bounce && rand_r(&m_seed)%4 == 0) {
+            Step up = {t+m_params->bounce/2,square};
+            Step down = {t+m_params->bounce,square};
+            m_steps.push_back(up);
+            m_steps.push_back(down);
+            t += m_params->bounce;
+        }
+    }
+
+    /** Works out the steps for the game, with new jitter and bounces. */
+    void generate() {
+        m_steps.clear();
+        thc::ChessRules cr;
+        uint64_t t=0;
+        for(size_t i=0; i<m_game->size(); i++) {
+            thc::Move mv = (*m_game)[i];
+            int src = mv.src, dst = mv.dst;
+            flip(t,src,m_params->think);
+            switch(mv.special) {
+                case thc::SPECIAL_WK_CASTLING: drop(t,dst,m_params->hand); flip(t,thc::h1,m_params->hand); drop(t,thc::f1,m_params->hand); break;
+                case thc::SPECIAL_WQ_CASTLING: drop(t,dst,m_params->hand); flip(t,thc::a1,m_params->hand); drop(t,thc::d1,m_params->hand); break;
+                case thc::SPECIAL_BK_CASTLING: drop(t,dst,m_params->hand); flip(t,thc::h8,m_params->hand); drop(t,thc::f8,m_params->hand); break;
+                case thc::SPECIAL_BQ_CASTLING: drop(t,dst,m_params->hand); flip(t,thc::a8,m_params->hand); drop(t,thc::d8,m_params->hand); break;
+                case thc::SPECIAL_WEN_PASSANT: drop(t,dst,m_params->hand); flip(t,dst+8,m_params->hand); break;
+                case thc::SPECIAL_BEN_PASSANT: drop(t,dst,m_params->hand); flip(t,dst-8,m_params->hand); break;
+                default:
+                    if(cr.squares[dst] != ' ')
+                        flip(t,dst,m_params->hand);
+                    drop(t,dst,m_params->hand);
+                    break;
+            }
+            cr.PlayMove(mv);
+        }
+        m_end = t+2*m_params->think;
+    }
+
+    uint64_t simNow() {
+        return (uint64_t)((monotonicMicros()-m_start)*m_params->speed);
+    }
+
+    bool due() {
+        return m_next < m_steps.size() && m_steps[m_next].time <= simNow();
+    }
+
+public:
+    SimulatedIO(const SimGame* game,SimParams* params,unsigned seed)
+            : m_game(game),m_params(params),m_seed(seed),m_next(0),m_end(0),m_changedAt(0) {
+        restart();
+    }
+
+    uint64_t scan() {
+        if(due()) {
+            uint64_t first = m_steps[m_next].time;
+            while(m_next < m_steps.size() && m_steps[m_next].time < first+m_params->scanWindow && m_steps[m_next].time <= simNow())
+                m_occupancy ^= 1ULL<<m_steps[m_next++].square;
+            m_changedAt = m_startEpoch+(uint64_t)(first/m_params->speed);
+        }
+        return m_occupancy;
+    }
+
+    uint64_t changedAt() {
+        return m_changedAt;
+    }
+
+    void setLed(int index,int on) {}
+    void setLeds(uint64_t on) {}
+
+    void delay(unsigned us) {
+        usleep((useconds_t)(us/m_params->speed));
+    }
+
+    bool backlog() {
+        return due();
+    }
+
+    bool ended() {
+        return m_next >= m_steps.size() && simNow() >= m_end;
+    }
+
+    /** Puts the pieces back where they start and plays the game again. */
+    bool restart() {
+        generate();
+        m_next = 0;
+        m_occupancy = 0xffff00000000ffffULL;
+        m_start = monotonicMicros();
+        m_startEpoch = frameTime();
+        return true;
+    }
+};
+
+#endif //CONTROLLER_SIMULATOR_HPP
@@ -0,0 +1,274 @@
+//
+// The games in progress, kept in a memory mapped file so a restarted controller carries on.
+//
+
+#ifndef CONTROLLER_STATEFILE_HPP
+#define CONTROLLER_STATEFILE_HPP
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "thc.h"
+#include "board.hpp"
+#include "binaryprotocol.hpp"
+#include "log.hpp"
+
+#define STATE_MAGIC "CLRS"
+#define STATE_VERSION 1
+
+/** A position, compressed with ChessPosition::Compress(), which leaves out the move clocks. */
+struct StatePosition {
+    thc::CompressedPosition position;
+    uint16_t halfMoveClock;
+    uint16_t fullMoveCount;
+};
+
+/**
+ * One board's game. The moves are kept as well as the position they lead to, the rules need
+ * them to see repetitions, so they're played again from the start when it is restored.
+ */
+struct BoardState {
+    uint32_t seq;               ///< Which save this is, the slot with the higher valid seq is the current one.
+    uint32_t crc;               ///< crc32 of everything after this field.
+    StatePosition start;        ///< Where the game started.
+    StatePosition current;
+    uint8_t gameMode;
+    uint8_t moveIndex;          ///< How far into the move being waited for the player is, see Board::moveType.
+    uint8_t movesNeeded;
+    char moveType[4];
+    int8_t moveSquareIndex[4];
+    int8_t waitFrom;            ///< The move being waited for, see Board::waitMove.
+    int8_t waitTo;
+    char waitType[18];
+    uint64_t squareState;
+    uint64_t ledOn;
+    uint64_t ledFlash;
+    uint16_t movesTruncated;    ///< Moves left out of the front of moves because it was full.
+    uint16_t moveCount;
+    uint16_t moves[600];        ///< The game's moves since start, packed like binary frames do (see packMove).
+};
+
+/** Start of the file, followed by two BoardStates for each board. */
+struct StateHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t boardCount;
+    uint32_t stateSize;         ///< sizeof(BoardState), so a file from a different build isn't misread.
+};
+
+/**
+ * The file is mapped shared, so what has been written survives the controller crashing, and
+ * msync() is asked to get it to disk soon after each save for when the power goes.
+ *
+ * Each board has two slots, and a save writes the one that isn't current, fills in its crc,
+ * and only then gives it a seq higher than the other's. A save that is cut short leaves a slot
+ * whose crc doesn't match, and the other slot, the previous save, is used.
+ */
+class StateFile {
+protected:
+    int m_fd;
+    size_t m_size;
+    StateHeader* m_header;
+    BoardState* m_states;
+    vector<unsigned> m_saved;   ///< Board::stateVersion of each board's last save.
+
+    static uint32_t checksum(const BoardState* state) {
+        const Bytef* start = (const Bytef*)&state->crc+sizeof(state->crc);
+        return (uint32_t)crc32(0,start,(const Bytef*)(state+1)-start);
+    }
+
+    static void savePosition(StatePosition& dst,const thc::ChessPosition& src) {
+        src.Compress(dst.position);
+        dst.halfMoveClock = (uint16_t)src.half_move_clock;
+        dst.fullMoveCount = (uint16_t)src.full_move_count;
+    }
+
+    static void loadPosition(thc::ChessPosition& dst,const StatePosition& src) {
+        dst.Decompress(src.position);
+        dst.half_move_clock = src.halfMoveClock;
+        dst.full_move_count = src.fullMoveCount;
+    }
+
+    static bool samePosition(const thc::ChessPosition& position,const StatePosition& saved) {
+        StatePosition mine;
+        savePosition(mine,position);
+        return !memcmp(&mine.position,&saved.position,sizeof(mine.position))
+                && mine.halfMoveClock == saved.halfMoveClock && mine.fullMoveCount == saved.fullMoveCount;
+    }
+
+    /** The slot holding the board's last complete save, or NULL if it has none. */
+    BoardState* current(int board) {
+        BoardState* a = &m_states[board*2];
+        BoardState* b = &m_states[board*2+1];
+        bool aValid = a->seq && a->crc == checksum(a);
+        bool bValid = b->seq && b->crc == checksum(b);
+        if(aValid && bValid)
+            return a->seq > b->seq ? a : b;
+        return aValid ? a : bValid ? b : NULL;
+    }
+
+    /** Asks for the pages a slot is on to be written out, without waiting for them. */
+    void flush(BoardState* state) {
+        uintptr_t page = (uintptr_t)getpagesize();
+        uintptr_t map = (uintptr_t)m_header;
+        uintptr_t start = (uintptr_t)state & ~(page-1);
+        uintptr_t end = ((uintptr_t)(state+1)+page-1) & ~(page-1);
+        if(end > map+m_size)
+            end = map+m_size;
+        msync((void*)start,end-start,MS_ASYNC);
+    }
+
+public:
+    StateFile() : m_fd(-1),m_size(0),m_header(NULL),m_states(NULL) {}
+    ~StateFile() {
+        if(m_header)
+            munmap(m_header,m_size);
+        if(m_fd >= 0)
+            close(m_fd);
+    }
+
+    bool opened() {
+        return m_header != NULL;
+    }
+
+    /**
+     * Maps the file, creating it if needed. A file written for a different number of boards or
+     * by a different version is started over.
+     */
+    bool open(const char* path,int boardCount) {
+        m_fd = ::open(path,O_RDWR|O_CREAT,0644);
+        if(m_fd < 0) {
+            perror(path);
+            return false;
+        }
+        m_size = sizeof(StateHeader)+2*boardCount*sizeof(BoardState);
+        struct stat st;
+        bool reuse = fstat(m_fd,&st) == 0 && (size_t)st.st_size == m_size;
+        if(!reuse && ftruncate(m_fd,0) < 0) {
+            perror(path);
+            return false;
+        }
+        if(ftruncate(m_fd,m_size) < 0) {
+            perror(path);
+            return false;
+        }
+        void* p = mmap(NULL,m_size,PROT_READ|PROT_WRITE,MAP_SHARED,m_fd,0);
+        if(p == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        m_header = (StateHeader*)p;
+        m_states = (BoardState*)(m_header+1);
+        if(!reuse || memcmp(m_header->magic,STATE_MAGIC,4) || m_header->version != STATE_VERSION
+                || m_header->boardCount != (uint32_t)boardCount || m_header->stateSize != sizeof(BoardState)) {
+            if(reuse)
+                LOG_WARN("%s is from a different setup, starting over",path);
+            memset(p,0,m_size);
+            memcpy(m_header->magic,STATE_MAGIC,4);
+            m_header->version = STATE_VERSION;
+            m_header->boardCount = boardCount;
+            m_header->stateSize = sizeof(BoardState);
+            msync(p,m_size,MS_ASYNC);
+        }
+        m_saved.assign(boardCount,~0u);
+        return true;
+    }
+
+    /**
+     * Puts the board's saved game back.
+     * @return false if there is no saved game for it, the board starts a new one then.
+     */
+    bool load(Board* board) {
+        if(!m_header || board->id >= (int)m_header->boardCount)
+            return false;
+        BoardState* state = current(board->id);
+        if(!state)
+            return false;
+        thc::ChessPosition current;
+        loadPosition(board->startPosition,state->start);
+        loadPosition(current,state->current);
+        board->rules.setPosition(board->startPosition);
+        board->played.clear();
+        for(int i=0; i<state->moveCount && !state->movesTruncated; i++) {
+            thc::Move mv;
+            if(!unpackMove(board->rules,state->moves[i],mv))
+                break;
+            board->rules.PlayMove(mv);
+            board->played.push_back(mv);
+        }
+        if(!samePosition(board->rules,state->current)) {
+            //too many moves to keep, or they don't add up: carry on without them
+            LOG_WARN("board %d resumes without its earlier moves, repetitions before now won't count",board->id);
+            board->rules.setPosition(current);
+            board->startPosition = current;
+            board->played.clear();
+        }
+        board->gameMode = state->gameMode;
+        board->moveIndex = state->moveIndex;
+        board->movesNeeded = state->movesNeeded;
+        for(int i=0; i<4; i++) {
+            board->moveType[i] = state->moveType[i];
+            board->moveSquareIndex[i] = state->moveSquareIndex[i];
+        }
+        if(state->waitFrom >= 0) {
+            board->waitMove.setFrom(state->waitFrom);
+            board->waitMove.setTo(state->waitTo);
+            board->waitMove.setType(state->waitType);
+        }
+        board->squareState = state->squareState;
+        board->ledOn = state->ledOn;
+        board->ledFlash = state->ledFlash;
+        if(board->gameMode != Board::MODE_MOVE) {
+            board->moveIndex = 0;   //a piece that was up can't be trusted to still be up
+            board->squareState = board->rules.occupancy();
+        }
+        m_saved[board->id] = board->stateVersion;
+        return true;
+    }
+
+    /** Saves the board's game if it changed since the last save. */
+    void save(Board* board) {
+        if(!m_header || board->id >= (int)m_header->boardCount || m_saved[board->id] == board->stateVersion)
+            return;
+        BoardState* last = current(board->id);
+        BoardState* state = &m_states[board->id*2] == last ? &m_states[board->id*2+1] : &m_states[board->id*2];
+        uint32_t seq = last ? last->seq+1 : 1;
+        state->seq = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        savePosition(state->start,board->startPosition);
+        savePosition(state->current,board->rules);
+        state->gameMode = board->gameMode;
+        state->moveIndex = board->moveIndex;
+        state->movesNeeded = board->movesNeeded;
+        for(int i=0; i<4; i++) {
+            state->moveType[i] = board->moveType[i];
+            state->moveSquareIndex[i] = board->moveSquareIndex[i];
+        }
+        state->waitFrom = board->gameMode == Board::MODE_MOVE ? board->waitMove.fromIndex() : -1;
+        state->waitTo = board->gameMode == Board::MODE_MOVE ? board->waitMove.toIndex() : -1;
+        snprintf(state->waitType,sizeof(state->waitType),"%s",board->waitMove.type());
+        state->squareState = board->squareState;
+        state->ledOn = board->ledOn;
+        state->ledFlash = board->ledFlash;
+        size_t capacity = sizeof(state->moves)/sizeof(state->moves[0]);
+        size_t count = board->played.size();
+        size_t first = count > capacity ? count-capacity : 0;
+        state->movesTruncated = (uint16_t)(first > 0xffff ? 0xffff : first);
+        state->moveCount = (uint16_t)(count-first);
+        for(size_t i=first; i<count; i++)
+            state->moves[i-first] = packMove(board->played[i]);
+        state->crc = checksum(state);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        state->seq = seq;
+        flush(state);
+        m_saved[board->id] = board->stateVersion;
+    }
+};
+
+#endif //CONTROLLER_STATEFILE_HPP
@@ -0,0 +1,409 @@
+//
+// WebSocket listener, so a browser can talk to the controller directly.
+//
+
+#ifndef CONTROLLER_WEBSOCKET_HPP
+#define CONTROLLER_WEBSOCKET_HPP
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <string>
+
+#include "listener.hpp"
+
+using namespace std;
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/** SHA-1 of the data, only used for the handshake's Sec-WebSocket-Accept. */
+inline void wsSha1(const string& data,unsigned char digest[20]) {
+    uint32_t h[5] = {0x67452301,0xEFCDAB89,0x98BADCFE,0x10325476,0xC3D2E1F0};
+    string msg = data;
+    uint64_t bits = (uint64_t)data.size()*8;
+    msg += (char)0x80;
+    while(msg.size()%64 != 56)
+        msg += (char)0;
+    for(int i=7; i>=0; i--)
+        msg += (char)(bits>>(i*8));
+    for(size_t chunk=0; chunk<msg.size(); chunk+=64) {
+        uint32_t w[80];
+        for(int i=0; i<16; i++) {
+            const unsigned char* p = (const unsigned char*)msg.data()+chunk+i*4;
+            w[i] = (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+        }
+        for(int i=16; i<80; i++) {
+            uint32_t t = w[i-3]^w[i-8]^w[i-14]^w[i-16];
+            w[i] = t<<1 | t>>31;
+        }
+        uint32_t a=h[0],b=h[1],c=h[2],d=h[3],e=h[4];
+        for(int i=0; i<80; i++) {
+            uint32_t f,k;
+            if(i<20)      {f=(b&c)|(~b&d);        k=0x5A827999;}
+            else if(i<40) {f=b^c^d;               k=0x6ED9EBA1;}
+            else if(i<60) {f=(b&c)|(b&d)|(c&d);   k=0x8F1BBCDC;}
+            else          {f=b^c^d;               k=0xCA62C1D6;}
+            uint32_t t = (a<<5|a>>27)+f+e+k+w[i];
+            e=d; d=c; c=b<<30|b>>2; b=a; a=t;
+        }
+        h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e;
+    }
+    for(int i=0; i<20; i++)
+        digest[i] = (unsigned char)(h[i/4]>>(24-(i%4)*8));
+}
+
+inline string wsBase64(const unsigned char* data,size_t n) {
+    static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    for(size_t i=0; i<n; i+=3) {
+        uint32_t v = (uint32_t)data[i]<<16 | (i+1<n ? (uint32_t)data[i+1]<<8 : 0) | (i+2<n ? data[i+2] : 0);
+        out += chars[v>>18&0x3f];
+        out += chars[v>>12&0x3f];
+        out += i+1<n ? chars[v>>6&0x3f] : '=';
+        out += i+2<n ? chars[v&0x3f] : '=';
+    }
+    return out;
+}
+
+/** Value of an HTTP header in the request, matched case insensitively, or "" if it isn't there. */
+inline string wsHeader(const string& request,const char* name) {
+    size_t len = strlen(name);
+    size_t pos = request.find("\r\n");
+    while(pos != string::npos && pos+2 < request.size()) {
+        size_t start = pos+2;
+        size_t end = request.find("\r\n",start);
+        if(end == string::npos)
+            break;
+        if(end-start > len && request[start+len] == ':' && !strncasecmp(request.c_str()+start,name,len)) {
+            size_t v = start+len+1;
+            while(v < end && request[v] == ' ')
+                v++;
+            return request.substr(v,end-v);
+        }
+        pos = end;
+    }
+    return "";
+}
+
+class WebSocketListener;
+
+/**
+ * A browser client. Every write is sent as one WebSocket message: text for json lines, with
+ * the line terminator dropped, and binary for binary protocol frames.
+ */
+class WebSocketConnection : public SocketConnection {
+public:
+    WebSocketListener* listener;
+    bool open;              ///< Handshake is done.
+    bool deflate;           ///< permessage-deflate was negotiated.
+    bool inflating;         ///< inflater has been initialised.
+    z_stream inflater;      ///< Client to server messages keep their compression context.
+    string message;         ///< Payload of a fragmented message received so far.
+    bool messageCompressed;
+
+    WebSocketConnection(int fd,WebSocketListener* l) : SocketConnection(fd),listener(l),open(false),deflate(false),inflating(false),messageCompressed(false) {
+        memset(&inflater,0,sizeof(inflater));
+    }
+    ~WebSocketConnection() {
+        if(inflating)
+            inflateEnd(&inflater);
+    }
+
+    void write(const char* buffer,size_t n);
+    void sendEvent(unsigned long seq,const string& line,const string& frame);
+
+    /** Sends already framed bytes. */
+    void writeRaw(const string& bytes) {
+        SocketConnection::write(bytes.data(),bytes.size());
+    }
+};
+
+/**
+ * Accepts WebSocket connections on a TCP port. Clients send the same json commands, one per
+ * text message, and get the same replies and events.
+ *
+ * permessage-deflate is offered with server_no_context_takeover, so every message the server
+ * sends is compressed on its own. That lets a broadcast event be framed and compressed once
+ * and the same bytes be sent to every browser.
+ */
+class WebSocketListener : public Listener {
+public:
+    enum {MAX_MESSAGE=64*1024};
+
+protected:
+    z_stream m_deflater;
+    bool m_deflating;
+    string m_scratch;
+
+    // The last event, framed for each kind of client. Filled in as clients need them.
+    unsigned long m_eventSeq;
+    string m_eventFrames[4];        ///< index is binary*2+deflate
+    bool m_eventReady[4];
+
+    SocketConnection* newConnection(int fd) {
+        return new WebSocketConnection(fd,this);
+    }
+
+    bool announceOnAccept() {return false;}
+
+    void process(SocketConnection* sconn) {
+        WebSocketConnection* conn = (WebSocketConnection*)sconn;
+        if(!conn->open) {
+            handshake(conn);
+            if(!conn->open)
+                return;
+        }
+        while(!conn->closing && readFrame(conn))
+            ;
+    }
+
+    void handshake(WebSocketConnection* conn) {
+        size_t end = conn->inbox.find("\r\n\r\n");
+        if(end == string::npos) {
+            if(conn->inbox.size() > 8192)
+                conn->closing = true;
+            return;
+        }
+        string request = conn->inbox.substr(0,end+2);
+        conn->inbox.erase(0,end+4);
+        string key = wsHeader(request,"Sec-WebSocket-Key");
+        string upgrade = wsHeader(request,"Upgrade");
+        if(key.empty() || strcasecmp(upgrade.c_str(),"websocket")) {
+            const char* bad = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn->SocketConnection::write(bad,strlen(bad));
+            conn->closing = true;
+            return;
+        }
+        unsigned char digest[20];
+        wsSha1(key+WS_GUID,digest);
+        string response = "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: "+wsBase64(digest,sizeof(digest))+"\r\n";
+        if(m_deflating && wsHeader(request,"Sec-WebSocket-Extensions").find("permessage-deflate") != string::npos) {
+            if(inflateInit2(&conn->inflater,-15) == Z_OK) {
+                conn->inflating = true;
+                conn->deflate = true;
+                response += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover\r\n";
+            }
+        }
+        response += "\r\n";
+        conn->writeRaw(response);
+        conn->open = true;
+        announce(conn);
+    }
+
+    /**
+     * Takes one frame off the front of the inbox.
+     * @return false if there isn't a complete frame yet.
+     */
+    bool readFrame(WebSocketConnection* conn) {
+        const string& in = conn->inbox;
+        if(in.size() < 2)
+            return false;
+        const unsigned char* p = (const unsigned char*)in.data();
+        bool fin = p[0]&0x80;
+        bool rsv1 = p[0]&0x40;
+        int opcode = p[0]&0x0f;
+        bool masked = p[1]&0x80;
+        uint64_t len = p[1]&0x7f;
+        size_t pos = 2;
+        if(len == 126) {
+            if(in.size() < 4)
+                return false;
+            len = (uint64_t)p[2]<<8 | p[3];
+            pos = 4;
+        } else if(len == 127) {
+            if(in.size() < 10)
+                return false;
+            len = 0;
+            for(int i=0; i<8; i++)
+                len = len<<8 | p[2+i];
+            pos = 10;
+        }
+        if(!masked || len > MAX_MESSAGE) {
+            conn->closing = true;   //clients must mask, and we don't take huge messages
+            return false;
+        }
+        if(in.size() < pos+4+len)
+            return false;
+        const unsigned char* mask = p+pos;
+        pos += 4;
+        string payload(len,'\0');
+        for(size_t i=0; i<len; i++)
+            payload[i] = p[pos+i]^mask[i%4];
+        conn->inbox.erase(0,pos+len);
+
+        switch(opcode) {
+            case 0x0:   //continuation
+                conn->message += payload;
+                break;
+            case 0x1:   //text
+            case 0x2:   //binary
+                conn->message = payload;
+                conn->messageCompressed = rsv1;
+                break;
+            case 0x8:   //close
+                sendControl(conn,0x8,payload);
+                conn->closing = true;
+                return false;
+            case 0x9:   //ping
+                sendControl(conn,0xA,payload);
+                return true;
+            default:    //pong and anything unknown
+                return true;
+        }
+        if(conn->message.size() > MAX_MESSAGE) {
+            conn->closing = true;
+            return false;
+        }
+        if(fin) {
+            string text;
+            if(conn->messageCompressed) {
+                if(!inflateMessage(conn,conn->message,text)) {
+                    conn->closing = true;
+                    return false;
+                }
+            } else {
+                text.swap(conn->message);
+            }
+            conn->message.clear();
+            //a message can hold one command, or several separated by newlines
+            size_t start=0;
+            while(start < text.size() && !conn->closing) {
+                size_t eol = text.find('\n',start);
+                if(eol == string::npos)
+                    eol = text.size();
+                string line = text.substr(start,eol-start);
+                if(!line.empty() && line[line.size()-1] == '\r')
+                    line.erase(line.size()-1);
+                if(!line.empty())
+                    m_handler->onLine(conn,&line[0]);
+                start = eol+1;
+            }
+        }
+        return true;
+    }
+
+    bool inflateMessage(WebSocketConnection* conn,string data,string& out) {
+        if(!conn->inflating)
+            return false;
+        data.append("\x00\x00\xff\xff",4);
+        conn->inflater.next_in = (Bytef*)&data[0];
+        conn->inflater.avail_in = data.size();
+        char buffer[4096];
+        do {
+            conn->inflater.next_out = (Bytef*)buffer;
+            conn->inflater.avail_out = sizeof(buffer);
+            int rc = inflate(&conn->inflater,Z_SYNC_FLUSH);
+            if(rc != Z_OK && rc != Z_BUF_ERROR)
+                return false;
+            out.append(buffer,sizeof(buffer)-conn->inflater.avail_out);
+            if(out.size() > MAX_MESSAGE)
+                return false;
+        } while(conn->inflater.avail_out == 0);
+        return true;
+    }
+
+    void sendControl(WebSocketConnection* conn,int opcode,const string& payload) {
+        string frame;
+        appendFrame(frame,opcode,false,payload.data(),payload.size() < 126 ? payload.size() : 125);
+        conn->writeRaw(frame);
+    }
+
+    /** Frame header and payload for one unfragmented server to client message. */
+    static void appendFrame(string& out,int opcode,bool compressed,const char* payload,size_t n) {
+        out += (char)(0x80 | (compressed ? 0x40 : 0) | opcode);
+        if(n < 126) {
+            out += (char)n;
+        } else if(n <= 0xffff) {
+            out += (char)126;
+            out += (char)(n>>8);
+            out += (char)n;
+        } else {
+            out += (char)127;
+            for(int i=7; i>=0; i--)
+                out += (char)((uint64_t)n>>(i*8));
+        }
+        out.append(payload,n);
+    }
+
+    /** Compresses a message on its own, as permessage-deflate with no context takeover expects. */
+    const string& deflateMessage(const char* data,size_t n) {
+        m_scratch.clear();
+        deflateReset(&m_deflater);
+        m_deflater.next_in = (Bytef*)data;
+        m_deflater.avail_in = n;
+        char buffer[4096];
+        do {
+            m_deflater.next_out = (Bytef*)buffer;
+            m_deflater.avail_out = sizeof(buffer);
+            deflate(&m_deflater,Z_SYNC_FLUSH);
+            m_scratch.append(buffer,sizeof(buffer)-m_deflater.avail_out);
+        } while(m_deflater.avail_out == 0);
+        if(m_scratch.size() >= 4)
+            m_scratch.erase(m_scratch.size()-4);    //drop the 00 00 ff ff the sync flush ends with
+        return m_scratch;
+    }
+
+public:
+    WebSocketListener(CommandHandler* handler) : Listener(handler),m_eventSeq(0) {
+        memset(&m_deflater,0,sizeof(m_deflater));
+        m_deflating = deflateInit2(&m_deflater,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) == Z_OK;
+        memset(m_eventReady,0,sizeof(m_eventReady));
+    }
+    ~WebSocketListener() {
+        if(m_deflating)
+            deflateEnd(&m_deflater);
+    }
+
+    bool listen(int port) {
+        return listenTcp(port);
+    }
+
+    /** Builds one complete message, compressed if asked. */
+    string message(bool binary,bool compressed,const char* data,size_t n) {
+        string out;
+        if(compressed && m_deflating) {
+            const string& z = deflateMessage(data,n);
+            appendFrame(out,binary ? 0x2 : 0x1,true,z.data(),z.size());
+        } else {
+            appendFrame(out,binary ? 0x2 : 0x1,false,data,n);
+        }
+        return out;
+    }
+
+    /** The event as a complete message for this kind of client, built the first time a client of that kind needs it. */
+    const string& eventMessage(unsigned long seq,bool binary,bool compressed,const string& line,const string& frame) {
+        if(seq != m_eventSeq) {
+            m_eventSeq = seq;
+            memset(m_eventReady,0,sizeof(m_eventReady));
+        }
+        int kind = (binary ? 2 : 0)+(compressed ? 1 : 0);
+        if(!m_eventReady[kind]) {
+            if(binary)
+                m_eventFrames[kind] = message(true,compressed,frame.data(),frame.size());
+            else
+                m_eventFrames[kind] = message(false,compressed,line.data(),line.size() >= 2 ? line.size()-2 : line.size());
+            m_eventReady[kind] = true;
+        }
+        return m_eventFrames[kind];
+    }
+};
+
+inline void WebSocketConnection::write(const char* buffer,size_t n) {
+    if(!open) {
+        SocketConnection::write(buffer,n);
+        return;
+    }
+    if(!binary && n >= 2 && buffer[n-2] == '\r' && buffer[n-1] == '\n')
+        n -= 2;
+    writeRaw(listener->message(binary,deflate,buffer,n));
+}
+
+inline void WebSocketConnection::sendEvent(unsigned long seq,const string& line,const string& frame) {
+    writeRaw(listener->eventMessage(seq,binary,deflate,line,frame));
+}
+
+#endif //CONTROLLER_WEBSOCKET_HPP
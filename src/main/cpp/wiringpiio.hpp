@@ -0,0 +1,126 @@
+//
+// A board driven through wiringPi, the way the controller has always talked to the chips.
+//
+
+#ifndef CONTROLLER_WIRINGPIIO_HPP
+#define CONTROLLER_WIRINGPIIO_HPP
+
+#include <stdio.h>
+#include <wiringPi.h>
+#include <wiringPiI2C.h>
+#include <mcp23017.h>
+
+#include "boardio.hpp"
+#include "log.hpp"
+
+/**
+ * An McpBoardIO through wiringPi. The board selects its multiplexer channel before it touches
+ * its chips. Inputs are read a register at a time, LEDs are written through the wiringPi pins.
+ */
+class WiringPiIO : public McpBoardIO {
+public:
+    enum {PINS_PER_BOARD=128};  ///< wiringPi pin numbers each board uses, 16 per chip.
+
+    int devId;                  ///< Address of the chip for the first row.
+    int pinBase;                ///< First wiringPi pin number of this board's chips.
+    int muxFd;
+    int output[64];             ///< Pin map for output. You use in your digitalWrite calls digitalWrite(output[squareIndex],state);. 1=on, 0=off.
+    int mcp[8];
+    int fd[8];                  ///< wiringPiI2C handle of each chip, for whole register reads.
+
+protected:
+    bool readRow(int row,uint8_t& inputs) {
+        int value = fd[row] < 0 ? -1 : wiringPiI2CReadReg8(fd[row],MCP_GPIOA);
+        if(value < 0) {
+            busErrors++;
+            return false;
+        }
+        inputs = (uint8_t)value;
+        return true;
+    }
+
+    bool readRegister(int row,uint8_t reg,uint8_t& value) {
+        int v = fd[row] < 0 ? -1 : wiringPiI2CReadReg8(fd[row],reg);
+        if(v < 0) {
+            busErrors++;
+            return false;
+        }
+        value = (uint8_t)v;
+        return true;
+    }
+
+    bool configureRow(int row) {
+        if(fd[row] < 0)
+            fd[row] = wiringPiI2CSetup(devId+row);
+        if(fd[row] < 0 || wiringPiI2CWriteReg8(fd[row],MCP_IODIRA,0xff) < 0 || wiringPiI2CWriteReg8(fd[row],MCP_GPPUA,0xff) < 0
+                || wiringPiI2CWriteReg8(fd[row],MCP_IODIRB,0) < 0) {
+            busErrors++;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    /**
+     * wiringPiSetup() must have been called first.
+     * @param board Index of the board, so each board gets its own wiringPi pin numbers.
+     * @param swap Swap the two reed switches that are wired the wrong way round on the first board.
+     */
+    WiringPiIO(int board,int mux,int channel,bool swapWiring)
+            : McpBoardIO(mux,channel,swapWiring),devId(FIRST_CHIP),pinBase(250-64*2+board*PINS_PER_BOARD),muxFd(-1) {
+        for(int row=0; row<ROWS; row++)
+            fd[row] = -1;
+    }
+
+    /**
+     * Registers the chips' pins with wiringPi, for the LEDs, and configures them a whole
+     * register at a time rather than with a pinMode() and pullUpDnControl() per pin.
+     *
+     * Every chip is configured, even one that kept its settings: mcp23017Setup() has to run for
+     * each of them for the LED pins to exist, and it writes to the chip, so reading the settings
+     * back to save the three writes after it gains nothing. Only I2cDevIO leaves them alone.
+     */
+    void setup() {
+        int index=0;
+        int baseInput=pinBase;
+        int baseOutput=baseInput+8;
+
+        if(muxAddress) {
+            muxFd = wiringPiI2CSetup(muxAddress);
+            if(muxFd<0)
+                perror("wiringPiI2CSetup mux");
+        }
+        select();
+
+        for(int row = 0; row<8; ++row) {
+            mcp[row]=mcp23017Setup(baseInput,devId+row);
+            if(mcp[row]<0) {
+                perror("wiringPiI2CSetup");
+                busErrors++;
+            }
+            fd[row]=wiringPiI2CSetup(devId+row);
+
+            for(int col=0; col<8; col++) {
+                int outputCol = 7-col;
+                output[index]=baseOutput+outputCol;
+                ++index;
+            }
+            baseInput+=16;
+            baseOutput+=16;
+        }
+        configureChips(false);
+    }
+
+    /** Points the multiplexer at this board. Does nothing for a board wired straight to the bus. */
+    void select() {
+        if(muxFd >= 0 && wiringPiI2CWrite(muxFd,1<<muxChannel) < 0)
+            busErrors++;
+    }
+
+    void setLed(int index,int on) {
+        if(chips[index/8].up)
+            digitalWrite(output[index],on?1:0);
+    }
+};
+
+#endif //CONTROLLER_WIRINGPIIO_HPP